@@ -0,0 +1,193 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+struct job {
+	const char *path;
+	char *text; /* Diagnostics */
+	size_t len;
+	int status;
+	int done;
+};
+
+struct batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct job *jobs;
+	size_t njobs;
+	size_t next; /* Next job to start */
+};
+
+
+int
+lint_path_buffered(const char *path, char **textp, size_t *lenp)
+{
+	struct makel ctx;
+	struct output out;
+	FILE *stream;
+	int fd, status;
+
+	stream = open_memstream(textp, lenp);
+	if (!stream)
+		eprintf("open_memstream:");
+	init_output(&out, stream);
+	init_cli_context(&ctx, &out);
+
+	/* A file that cannot be opened shall not stop the
+	 * other files from being checked, so unlike in
+	 * load_makefile(), this is not a fatal error */
+	if (!strcmp(path, "-")) {
+		fd = dup(STDIN_FILENO);
+		path = "<stdin>";
+	} else {
+		fd = open(path, O_RDONLY);
+	}
+	if (fd < 0) {
+		print_file_error(&out, path, errno, "open %s O_RDONLY", path);
+		status = EXIT_ERROR;
+	} else {
+		status = lint_fd_cached(&ctx, fd, path, &out);
+		if (status < 0) {
+			print_file_error(&out, path, errno, "%s", path);
+			status = EXIT_ERROR;
+		}
+		close(fd);
+	}
+
+	destroy_output(&out);
+	destroy_cli_context(&ctx);
+	if (fclose(stream))
+		eprintf("fclose <memory stream>:");
+	return status;
+}
+
+
+static void *
+worker(void *arg)
+{
+	struct batch *batch = arg;
+	struct job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&batch->mutex);
+		if (batch->next == batch->njobs) {
+			pthread_mutex_unlock(&batch->mutex);
+			return NULL;
+		}
+		job = &batch->jobs[batch->next++];
+		pthread_mutex_unlock(&batch->mutex);
+
+		job->status = lint_path_buffered(job->path, &job->text, &job->len);
+
+		pthread_mutex_lock(&batch->mutex);
+		job->done = 1;
+		pthread_cond_signal(&batch->cond);
+		pthread_mutex_unlock(&batch->mutex);
+	}
+}
+
+
+size_t
+default_job_count(void)
+{
+	long int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return ncpus > 0 ? (size_t)ncpus : 1;
+}
+
+
+/* Returns the most serious exit status, and if `statuses` is not
+ * NULL, stores the exit status for each file in it */
+int
+lint_batch(const char *const *paths, size_t npaths, size_t jobs, int *statuses)
+{
+	struct batch batch;
+	pthread_t *threads;
+	size_t i, nthreads;
+	int status = 0;
+
+	if (!npaths)
+		return 0;
+
+	if (!jobs)
+		jobs = default_job_count();
+	nthreads = jobs < npaths ? jobs : npaths;
+
+	batch.jobs = ecalloc(npaths, sizeof(*batch.jobs));
+	batch.njobs = npaths;
+	batch.next = 0;
+	for (i = 0; i < npaths; i++)
+		batch.jobs[i].path = paths[i];
+	if ((errno = pthread_mutex_init(&batch.mutex, NULL)))
+		eprintf("pthread_mutex_init:");
+	if ((errno = pthread_cond_init(&batch.cond, NULL)))
+		eprintf("pthread_cond_init:");
+
+	threads = ecalloc(nthreads, sizeof(*threads));
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&threads[i], NULL, worker, &batch)))
+			eprintf("pthread_create:");
+
+	/* Files are checked in any order, but their diagnostics
+	 * are printed in the order the files were specified */
+	for (i = 0; i < npaths; i++) {
+		pthread_mutex_lock(&batch.mutex);
+		while (!batch.jobs[i].done)
+			pthread_cond_wait(&batch.cond, &batch.mutex);
+		pthread_mutex_unlock(&batch.mutex);
+
+		write_output(stderr, batch.jobs[i].text, batch.jobs[i].len);
+		free(batch.jobs[i].text);
+		status = MAX(status, batch.jobs[i].status);
+		if (statuses)
+			statuses[i] = batch.jobs[i].status;
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.mutex);
+	free(batch.jobs);
+	return status;
+}
+
+
+/* All paths are stored in one allocation, pointed to by the first path */
+char **
+read_path_list(int fd, size_t *npathsp)
+{
+	char **paths = NULL, *buf = NULL;
+	size_t size = 0, len = 0, i, start, npaths_size = 0;
+	ssize_t r;
+
+	for (;;) {
+		if (len == size)
+			buf = erealloc(buf, size = size ? size * 2 : 4096);
+		r = read(fd, &buf[len], size - len);
+		if (r > 0)
+			len += (size_t)r;
+		else if (!r)
+			break;
+		else if (errno != EINTR)
+			eprintf("read <stdin>:");
+	}
+	buf = erealloc(buf, len + 1);
+	buf[len] = '\0'; /* In case the last path is not terminated */
+
+	/* The list is NUL-separated, as output by find -print0 */
+	*npathsp = 0;
+	for (i = start = 0; i <= len; i++) {
+		if (buf[i])
+			continue;
+		if (i > start) {
+			if (*npathsp == npaths_size)
+				paths = erealloc(paths, (npaths_size = npaths_size ? npaths_size * 2 : 64) * sizeof(*paths));
+			paths[(*npathsp)++] = &buf[start];
+		}
+		start = i + 1;
+	}
+
+	if (!*npathsp)
+		free(buf);
+	return paths;
+}
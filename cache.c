@@ -0,0 +1,289 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Must be incremented whenever a change to makel can change
+ * the diagnostics or exit status for any file, so that results
+ * from other versions in the cache are not used */
+#define CACHE_VERSION 7
+
+
+const char *cache_dir = NULL;
+
+
+#define P1 UINT64_C(11400714785074694791)
+#define P2 UINT64_C(14029467366897019727)
+#define P3 UINT64_C(1609587929392839161)
+#define P4 UINT64_C(9650029242287828579)
+#define P5 UINT64_C(2870177450012600261)
+
+#define ROTL(X, N) (((X) << (N)) | ((X) >> (64 - (N))))
+
+static uint64_t
+load64(const unsigned char *s)
+{
+	uint64_t x;
+	memcpy(&x, s, sizeof(x));
+	return x;
+}
+
+static uint32_t
+load32(const unsigned char *s)
+{
+	uint32_t x;
+	memcpy(&x, s, sizeof(x));
+	return x;
+}
+
+static uint64_t
+hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	return ROTL(acc, 31) * P1;
+}
+
+static uint64_t
+hash_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= hash_round(0, v);
+	return acc * P1 + P4;
+}
+
+/* XXH64, chosen because it hashes several bytes per cycle; the cache
+ * does not have to be resistant to deliberate collisions, it is only
+ * written by makel and a hit is verified against the key text */
+uint64_t
+hash_data(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *s = data, *end = &s[len];
+	uint64_t h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		v1 = seed + P1 + P2;
+		v2 = seed + P2;
+		v3 = seed;
+		v4 = seed - P1;
+		for (; end - s >= 32; s += 32) {
+			v1 = hash_round(v1, load64(&s[0]));
+			v2 = hash_round(v2, load64(&s[8]));
+			v3 = hash_round(v3, load64(&s[16]));
+			v4 = hash_round(v4, load64(&s[24]));
+		}
+		h = ROTL(v1, 1) + ROTL(v2, 7) + ROTL(v3, 12) + ROTL(v4, 18);
+		h = hash_merge(h, v1);
+		h = hash_merge(h, v2);
+		h = hash_merge(h, v3);
+		h = hash_merge(h, v4);
+	} else {
+		h = seed + P5;
+	}
+	h += (uint64_t)len;
+
+	for (; end - s >= 8; s += 8) {
+		h ^= hash_round(0, load64(s));
+		h = ROTL(h, 27) * P1 + P4;
+	}
+	if (end - s >= 4) {
+		h ^= (uint64_t)load32(s) * P1;
+		h = ROTL(h, 23) * P2 + P3;
+		s += 4;
+	}
+	for (; s != end; s++) {
+		h ^= (uint64_t)*s * P5;
+		h = ROTL(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+/* Everything that the result depends on, apart from the
+ * file's content, of which only the hash and size is used;
+ * the output format is included as the formatted output
+ * is what is stored */
+static char *
+make_key(struct makel *ctx, const char *path, const void *data, size_t size)
+{
+	char *key, *p;
+	size_t i;
+
+	key = emalloc(strlen(path) + NUM_WARNING_CLASS + 128);
+	p = key;
+	p += sprintf(p, "makel-cache %i\n%s\n", CACHE_VERSION, path);
+	p += sprintf(p, "%zu %i %i %i %zu\n", ctx->style.max_line_length, ctx->style.only_empty_blank_lines,
+	             (int)ctx->style.macro_bracket_style, (int)output_format, ctx->max_warnings);
+	for (i = 0; i < NUM_WARNING_CLASS; i++)
+		*p++ = (char)('0' + ctx->actions[i]);
+	sprintf(p, "\n%016llx %zu\n", (unsigned long long int)hash_data(data, size, 0), size);
+	return key;
+}
+
+
+static char *
+get_entry_path(const char *key)
+{
+	char *path = emalloc(strlen(cache_dir) + sizeof("/0123456789abcdef"));
+	sprintf(path, "%s/%016llx", cache_dir, (unsigned long long int)hash_data(key, strlen(key), 0));
+	return path;
+}
+
+
+/* An entry is the key, the exit status, and the diagnostics,
+ * separated by NUL bytes; returns the exit status or -1 if
+ * there is no usable entry */
+static int
+lookup(const char *entry_path, const char *key, FILE *stream)
+{
+	char *buf = NULL, *status_str, *text, *end;
+	size_t size = 0, len = 0;
+	ssize_t r;
+	long int status;
+	int fd, ret = -1;
+
+	fd = open(entry_path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	for (;;) {
+		if (len == size)
+			buf = erealloc(buf, size = size ? size * 2 : 4096);
+		r = read(fd, &buf[len], size - len);
+		if (r > 0)
+			len += (size_t)r;
+		else if (!r)
+			break;
+		else if (errno != EINTR)
+			goto out;
+	}
+
+	/* Different keys can have the same hash */
+	if (len < strlen(key) + 1 || memcmp(buf, key, strlen(key) + 1))
+		goto out;
+	status_str = &buf[strlen(key) + 1];
+	text = memchr(status_str, '\0', len - (size_t)(status_str - buf));
+	if (!text)
+		goto out;
+	text++;
+
+	errno = 0;
+	status = strtol(status_str, &end, 10);
+	if (errno || *end || status < 0 || status > EXIT_ERROR)
+		goto out;
+
+	write_output(stream, text, len - (size_t)(text - buf));
+	ret = (int)status;
+
+out:
+	close(fd);
+	free(buf);
+	return ret;
+}
+
+
+/* The entry is written to a temporary file that is then renamed,
+ * so other processes using the same cache directory will either
+ * see the complete entry or no entry; failure to store an entry
+ * is not an error, the file will just be checked again next time */
+static void
+store(const char *entry_path, const char *key, int status, const char *text, size_t len)
+{
+	char *tmp_path, status_str[3 * sizeof(int) + 2];
+	int fd, failed;
+
+	if (mkdir(cache_dir, 0777) && errno != EEXIST)
+		return;
+
+	tmp_path = emalloc(strlen(entry_path) + sizeof(".tmp.XXXXXX"));
+	stpcpy(stpcpy(tmp_path, entry_path), ".tmp.XXXXXX");
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		free(tmp_path);
+		return;
+	}
+
+	sprintf(status_str, "%i", status);
+	failed = writeall(fd, key, strlen(key) + 1) ||
+	         writeall(fd, status_str, strlen(status_str) + 1) ||
+	         writeall(fd, text, len);
+	if (close(fd))
+		failed = 1;
+	if (failed || rename(tmp_path, entry_path))
+		unlink(tmp_path);
+	free(tmp_path);
+}
+
+
+static int
+lint_fd_uncached(struct makel *ctx, int fd, const char *path, struct output *out)
+{
+	int status, saved_errno;
+
+	status = makel_lint_fd(ctx, fd, path);
+	saved_errno = errno;
+	end_output(out);
+	errno = saved_errno;
+	return status;
+}
+
+
+/* When this function returns, all diagnostics for the file have been printed */
+int
+lint_fd_cached(struct makel *ctx, int fd, const char *path, struct output *out)
+{
+	struct stat st;
+	void *map;
+	char *key, *entry_path, *text = NULL;
+	size_t len = 0;
+	FILE *capture, *stream = out->stream;
+	int status, saved_errno;
+
+	/* Diagnostics before this file's are printed first, so
+	 * that they are not included in the cached diagnostics */
+	end_output(out);
+	ctx->user = out;
+
+	/* Only regular files are cached, there is no
+	 * point in hashing a file we cannot read again */
+	if (!cache_dir || fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    (uintmax_t)st.st_size > SIZE_MAX || lseek(fd, 0, SEEK_CUR))
+		return lint_fd_uncached(ctx, fd, path, out);
+	if (!st.st_size) {
+		map = NULL;
+	} else {
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			return lint_fd_uncached(ctx, fd, path, out);
+	}
+	key = make_key(ctx, path, map ? map : "", (size_t)st.st_size);
+	if (map)
+		munmap(map, (size_t)st.st_size);
+	entry_path = get_entry_path(key);
+
+	status = lookup(entry_path, key, stream);
+	if (status < 0) {
+		capture = open_memstream(&text, &len);
+		if (!capture)
+			eprintf("open_memstream:");
+		out->stream = capture;
+		status = lint_fd_uncached(ctx, fd, path, out);
+		saved_errno = errno;
+		out->stream = stream;
+		if (fclose(capture))
+			eprintf("fclose <memory stream>:");
+		write_output(stream, text, len);
+		/* The key does not cover included files, or
+		 * which prerequisites exist in the filesystem */
+		if (status >= 0 && !ctx->followed_includes && !ctx->graph.checked_files)
+			store(entry_path, key, status, text, len);
+		free(text);
+		errno = saved_errno;
+	}
+
+	free(entry_path);
+	free(key);
+	return status;
+}
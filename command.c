@@ -0,0 +1,181 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* A command line is scanned with a state machine, over the classes
+ * of its bytes, that follows sh(1)'s quoting and make(1)'s macro
+ * expansions at the same time; make(1) expands macros before sh(1)
+ * sees the line, so a macro expansion can be anywhere, even inside
+ * single quotes. The macro expansions are not expanded, they are
+ * assumed to expand to a part of a word.
+ *
+ * Most bytes only matter to the state machine in that they are
+ * or are not <blank>s, so rather than stepping through every byte,
+ * runs of bytes that cannot leave the current set of states are
+ * skipped with find_any_byte(), and only their last byte is applied
+ * to the state machine. */
+
+
+enum byte_class {
+	B_OTHER,
+	B_BLANK,
+	B_NEWLINE,
+	B_OPERATOR,
+	B_HASH,
+	B_SINGLE_QUOTE,
+	B_DOUBLE_QUOTE,
+	B_BACKSLASH,
+	B_DOLLAR,
+	B_PREFIX,
+	B_PAREN_OPEN,
+	B_PAREN_CLOSE,
+	B_BRACE_OPEN,
+	B_BRACE_CLOSE,
+	NUM_BYTE_CLASSES
+};
+
+static const unsigned char byte_classes[256] = {
+	[' '] = B_BLANK, ['\t'] = B_BLANK, ['\n'] = B_NEWLINE,
+	[';'] = B_OPERATOR, ['&'] = B_OPERATOR, ['|'] = B_OPERATOR, ['<'] = B_OPERATOR, ['>'] = B_OPERATOR,
+	['#'] = B_HASH, ['\''] = B_SINGLE_QUOTE, ['"'] = B_DOUBLE_QUOTE, ['\\'] = B_BACKSLASH, ['$'] = B_DOLLAR,
+	['@'] = B_PREFIX, ['-'] = B_PREFIX, ['+'] = B_PREFIX,
+	['('] = B_PAREN_OPEN, [')'] = B_PAREN_CLOSE, ['{'] = B_BRACE_OPEN, ['}'] = B_BRACE_CLOSE
+};
+
+/* The state after a byte; the rows for CMD_DOLLAR and CMD_MACRO, and
+ * the B_DOLLAR column, are only used for bytes in skipped runs, as
+ * macro expansions are followed by scan_command() itself */
+#define PRE CMD_PREFIX
+#define WS  CMD_WORD_START
+#define WD  CMD_WORD
+#define ES  CMD_ESCAPE_START
+#define EW  CMD_ESCAPE_WORD
+#define SQ  CMD_SINGLE_QUOTE
+#define DQ  CMD_DOUBLE_QUOTE
+#define DE  CMD_DOUBLE_ESCAPE
+#define CM  CMD_COMMENT
+#define DL  CMD_DOLLAR
+#define MC  CMD_MACRO
+static const unsigned char transitions[NUM_COMMAND_STATES][NUM_BYTE_CLASSES] = {
+	/*                    other blank  \n  ;&|<>  #   '   "   \   $  @-+  (   )   {   } */
+	[CMD_PREFIX]        = {WD,  PRE,  WS,  WS,  CM, SQ, DQ, ES, PRE, PRE, WS, WS, WD, WD},
+	[CMD_WORD_START]    = {WD,  WS,   WS,  WS,  CM, SQ, DQ, ES, WS,  WD,  WS, WS, WD, WD},
+	[CMD_WORD]          = {WD,  WS,   WS,  WS,  WD, SQ, DQ, EW, WD,  WD,  WS, WS, WD, WD},
+	[CMD_ESCAPE_START]  = {WD,  WD,   WS,  WD,  WD, WD, WD, WD, WD,  WD,  WD, WD, WD, WD},
+	[CMD_ESCAPE_WORD]   = {WD,  WD,   WD,  WD,  WD, WD, WD, WD, WD,  WD,  WD, WD, WD, WD},
+	[CMD_SINGLE_QUOTE]  = {SQ,  SQ,   SQ,  SQ,  SQ, WD, SQ, SQ, SQ,  SQ,  SQ, SQ, SQ, SQ},
+	[CMD_DOUBLE_QUOTE]  = {DQ,  DQ,   DQ,  DQ,  DQ, DQ, WD, DE, DQ,  DQ,  DQ, DQ, DQ, DQ},
+	[CMD_DOUBLE_ESCAPE] = {DQ,  DQ,   DQ,  DQ,  DQ, DQ, DQ, DQ, DQ,  DQ,  DQ, DQ, DQ, DQ},
+	[CMD_COMMENT]       = {CM,  CM,   WS,  CM,  CM, CM, CM, CM, CM,  CM,  CM, CM, CM, CM},
+	[CMD_DOLLAR]        = {DL,  DL,   DL,  DL,  DL, DL, DL, DL, DL,  DL,  DL, DL, DL, DL},
+	[CMD_MACRO]         = {MC,  MC,   MC,  MC,  MC, MC, MC, MC, MC,  MC,  MC, MC, MC, MC}
+};
+#undef PRE
+#undef WS
+#undef WD
+#undef ES
+#undef EW
+#undef SQ
+#undef DQ
+#undef DE
+#undef CM
+#undef DL
+#undef MC
+
+/* The bytes that can move a state to a state with another set of
+ * bytes here, or whose effect depends on the bytes before them;
+ * NULL for states that are left after any byte; stop_classes[] is
+ * the same as byte classes, and is used to look for the end of a run
+ * in its first few bytes, as runs are often too short for calling
+ * find_any_byte() to be worth it */
+#define C(CLASS) (1U << (CLASS))
+static const unsigned stop_classes[NUM_COMMAND_STATES] = {
+	[CMD_PREFIX]        = ~0U,
+	[CMD_WORD_START]    = C(B_HASH) | C(B_SINGLE_QUOTE) | C(B_DOUBLE_QUOTE) | C(B_BACKSLASH) | C(B_DOLLAR),
+	[CMD_WORD]          = C(B_HASH) | C(B_SINGLE_QUOTE) | C(B_DOUBLE_QUOTE) | C(B_BACKSLASH) | C(B_DOLLAR),
+	[CMD_ESCAPE_START]  = ~0U,
+	[CMD_ESCAPE_WORD]   = ~0U,
+	[CMD_SINGLE_QUOTE]  = C(B_SINGLE_QUOTE) | C(B_DOLLAR),
+	[CMD_DOUBLE_QUOTE]  = C(B_DOUBLE_QUOTE) | C(B_BACKSLASH) | C(B_DOLLAR),
+	[CMD_DOUBLE_ESCAPE] = ~0U,
+	[CMD_COMMENT]       = C(B_NEWLINE) | C(B_DOLLAR),
+	[CMD_DOLLAR]        = ~0U,
+	[CMD_MACRO]         = C(B_PAREN_OPEN) | C(B_PAREN_CLOSE) | C(B_BRACE_OPEN) | C(B_BRACE_CLOSE)
+};
+#undef C
+static const char *const stop_bytes[NUM_COMMAND_STATES] = {
+	[CMD_PREFIX]        = NULL,
+	[CMD_WORD_START]    = "#'\"\\$",
+	[CMD_WORD]          = "#'\"\\$",
+	[CMD_ESCAPE_START]  = NULL,
+	[CMD_ESCAPE_WORD]   = NULL,
+	[CMD_SINGLE_QUOTE]  = "'$",
+	[CMD_DOUBLE_QUOTE]  = "\"\\$",
+	[CMD_DOUBLE_ESCAPE] = NULL,
+	[CMD_COMMENT]       = "\n$",
+	[CMD_DOLLAR]        = NULL,
+	[CMD_MACRO]         = "(){}"
+};
+
+
+#define SHORT_RUN 16
+
+
+void
+init_command_scanner(struct command_scanner *scanner)
+{
+	scanner->state = CMD_PREFIX;
+	scanner->outer = CMD_PREFIX;
+	scanner->open = 0;
+	scanner->depth = 0;
+}
+
+
+/* Scans a part of a command line, the line may be given in any
+ * number of parts, for example as the spans of a logical line;
+ * afterwards, scanner->state is the state at the end of the part */
+void
+scan_command(struct command_scanner *scanner, const char *s, size_t n)
+{
+	size_t i = 0, run, max;
+	enum byte_class class;
+	unsigned stops;
+
+	while (i < n) {
+		stops = stop_classes[scanner->state];
+		max = MIN(n - i, SHORT_RUN);
+		for (run = 0; run < max && !(stops & (1U << byte_classes[(unsigned char)s[i + run]])); run++);
+		if (run == SHORT_RUN)
+			run += find_any_byte(&s[i + run], n - i - run, stop_bytes[scanner->state]);
+		if (run) {
+			class = byte_classes[(unsigned char)s[i + run - 1]];
+			scanner->state = transitions[scanner->state][class];
+			i += run;
+			continue;
+		}
+
+		class = byte_classes[(unsigned char)s[i]];
+		if (scanner->state == CMD_DOLLAR) {
+			if (class == B_PAREN_OPEN || class == B_BRACE_OPEN) {
+				scanner->state = CMD_MACRO;
+				scanner->open = s[i];
+				scanner->depth = 1;
+			} else {
+				/* A single-character macro, or $$, which is a
+				 * <dollar-sign> to sh(1); either is a part of a word */
+				scanner->state = transitions[scanner->outer][B_OTHER];
+			}
+		} else if (scanner->state == CMD_MACRO) {
+			if (s[i] == scanner->open)
+				scanner->depth++;
+			else if (s[i] == (scanner->open == '(' ? ')' : '}') && !--scanner->depth)
+				scanner->state = transitions[scanner->outer][B_OTHER];
+		} else if (class == B_DOLLAR) {
+			scanner->outer = scanner->state;
+			scanner->state = CMD_DOLLAR;
+		} else {
+			scanner->state = transitions[scanner->state][class];
+		}
+		i++;
+	}
+}
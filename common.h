@@ -1,18 +1,37 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
 #include <errno.h>
+#include <dirent.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
+#if defined(__linux__)
+# include <sys/inotify.h>
+# include <sys/signalfd.h>
+#endif
 
 #include <grapheme.h>
 
 #include "arg.h"
+#include "libmakel.h"
 
 
 #if defined(__GNUC__)
@@ -33,8 +52,14 @@
 #define EXIT_ERROR         8
 
 
+/* Enough to see what is wrong, without printing a diagnostic
+ * for every byte of a binary file that is checked by mistake */
+#define DEFAULT_MAX_WARNINGS 100
+
+
 #define ELEMSOF(ARRAY) (sizeof(ARRAY) / sizeof(*(ARRAY)))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
+#define MIN(A, B) ((A) < (B) ? (A) : (B))
 
 
 #define LIST_WARNING_CLASSES(X)\
@@ -52,14 +77,22 @@
 	X(WC_EOF_LINE_CONTINUATION, "eof-line-continuation", WARN)\
 	X(WC_UNINDENTED_CONTINUATION, "unindented-continuation", WARN)\
 	X(WC_SPACELESS_CONTINUATION, "spaceless-continuation", WARN)\
-	X(WC_COMMENT_CONTINUATION, "comment-continuation", WARN)
+	X(WC_COMMENT_CONTINUATION, "comment-continuation", WARN)\
+	X(WC_INCLUDE, "include", WARN)\
+	X(WC_MACRO_BRACKET, "macro-bracket", WARN_STYLE)\
+	X(WC_UNDEFINED_MACRO, "undefined-macro", INFORM)\
+	X(WC_UNUSED_MACRO, "unused-macro", INFORM)\
+	X(WC_POSIX_TARGET, "posix-target", WARN)\
+	X(WC_DUPLICATE_COMMANDS, "duplicate-commands", WARN)\
+	X(WC_DEPENDENCY_CYCLE, "dependency-cycle", WARN)\
+	X(WC_NO_RULE, "no-rule", WARN)
 
 
 enum action {
-	IGNORE,
-	INFORM,
-	WARN_STYLE,
-	WARN
+	IGNORE = MAKEL_IGNORE,
+	INFORM = MAKEL_INFORM,
+	WARN_STYLE = MAKEL_WARN_STYLE,
+	WARN = MAKEL_WARN
 };
 
 enum warning_class {
@@ -82,14 +115,145 @@ enum line_class {
 	OTHER
 };
 
-struct line {
+/* Flags in struct file.flags */
+#define LINE_EOF          0x01 /* Last line in the file */
+#define LINE_CONTINUED    0x02 /* Line continuation, the <backslash> is not included in the line's length */
+#define LINE_CMD_JOINER   0x04 /* If LINE_CONTINUED, the line shall be joined with '\\\n' rather than ' ' */
+
+struct file {
+	const char *path;
+	int nest_level;
+
 	char *data;
+	size_t size;
+	int mapped;
+
+	/* Lines that have been rewritten, they are addressed by offsets
+	 * starting at .size, and are not necessarily in order */
+	char *extra;
+	size_t extra_len;
+	size_t extra_size;
+
+	/* The line table, each line is .lengths[i] bytes (not including
+	 * the <newline>) starting at offset .offsets[i], and its line
+	 * number is .line_offset + i + 1 */
+	size_t line_offset; /* Only non-zero when the file is streamed */
+	size_t nlines;
+	size_t *offsets;
+	size_t *lengths;
+	unsigned char *flags;
+};
+
+#define LINE_DATA(FILE, I)\
+	((FILE)->offsets[I] < (FILE)->size ? &(FILE)->data[(FILE)->offsets[I]] :\
+	                                     &(FILE)->extra[(FILE)->offsets[I] - (FILE)->size])
+
+#define LINE_NUMBER(FILE, I) ((FILE)->line_offset + (I) + 1)
+
+/* A part of a logical line, either the text of a physical
+ * line or the text that joins it with the next line */
+struct span {
+	const char *s;
 	size_t len;
-	const char *path;
-	size_t lineno;
+	size_t line; /* The physical line, or the line before the joiner */
+};
+
+/* A logical line, read as spans with next_span(), so
+ * that continued lines are never copied to be joined */
+struct logical_line {
+	const struct file *file;
+	size_t first;
+	size_t next;
+	int at_joiner;
+	int done;
+};
+
+/* What a command line, as sh(1) will see it once make(1) has
+ * expanded its macros, is in at some point while it is scanned */
+enum command_state {
+	CMD_PREFIX,        /* Before the command, where <at-sign>, <hyphen-minus> and <plus-sign> are make(1)'s */
+	CMD_WORD_START,
+	CMD_WORD,
+	CMD_ESCAPE_START,  /* After an unquoted <backslash> at the start of a word */
+	CMD_ESCAPE_WORD,   /* After an unquoted <backslash> within a word */
+	CMD_SINGLE_QUOTE,
+	CMD_DOUBLE_QUOTE,
+	CMD_DOUBLE_ESCAPE, /* After a <backslash> within double quotes */
+	CMD_COMMENT,
+	CMD_DOLLAR,        /* After a <dollar-sign>, which make(1) expands */
+	CMD_MACRO,         /* Within a macro expansion */
+	NUM_COMMAND_STATES
+};
+
+struct command_scanner {
+	enum command_state state;
+	enum command_state outer; /* The state before a macro expansion */
+	char open;                /* The bracket that the macro expansion began with */
+	size_t depth;             /* The number of unclosed brackets in the macro expansion */
+};
+
+/* A file that is read one line at a time, so that only the
+ * lines read since the last call to drop_text_lines() are
+ * kept in .file; .file.size is the size of the buffer */
+struct text_stream {
+	struct file file;
+	int fd;
 	int eof;
-	int nest_level;
-	char continuation_joiner; /* If '\\', it shall be '\\\n' */
+	size_t len;        /* The number of bytes in the buffer */
+	size_t base;       /* The offset of the first byte in the first line in .file */
+	size_t start;      /* The offset of the first byte that is not in a line */
+	size_t scanned;    /* The number of bytes that have been searched for a <newline> */
+	size_t table_size; /* The number of lines the line table has room for */
+};
+
+/* The parts of checking a file that are timed with -t */
+enum phase {
+	PHASE_LOAD,          /* load_text_file(), or read_text_line() */
+	PHASE_ENCODING,      /* check_utf8_encoding() */
+	PHASE_COLUMNS,       /* check_column_count() */
+	PHASE_CONTINUATIONS, /* check_line_continuation() */
+	PHASE_CLASSIFY,      /* classify_line() */
+	PHASE_MACROS,        /* scan_macros() */
+	PHASE_RULES,         /* scan_rules() */
+	NUM_PHASES
+};
+
+struct phase_stats {
+	uint64_t wall_ns; /* Summed over threads */
+	size_t calls;
+	size_t lines;
+	size_t bytes;
+};
+
+struct stats {
+	struct phase_stats phases[NUM_PHASES];
+};
+
+/* Statistics are only collected if the context's .stats is set,
+ * otherwise a phase only costs the test of .stats; the timer is a
+ * struct timespec, only the wall time is measured for each phase,
+ * as the CPU time of the thread takes a system call to read */
+#define BEGIN_PHASE(CTX, TIMER)\
+	((CTX)->stats ? (void)clock_gettime(CLOCK_MONOTONIC, (TIMER)) : (void)0)
+#define END_PHASE(CTX, TIMER, PHASE, LINES, BYTES)\
+	((CTX)->stats ? end_phase((CTX)->stats, (TIMER), (PHASE), (LINES), (BYTES)) : (void)0)
+
+enum output_format {
+	FORMAT_TEXT,
+	FORMAT_JSONL,
+	FORMAT_SARIF
+};
+
+/* Where the command line interface prints diagnostics; in the
+ * machine-readable formats, a warning is kept in .record until
+ * it is known that no more notes will be attached to it */
+struct output {
+	FILE *stream;
+	char *record;
+	size_t record_len;
+	size_t record_size;
+	const char *class_name; /* The class of the warning in .record, NULL if none */
+	size_t nnotes;
 };
 
 enum macro_bracket_style {
@@ -104,36 +268,368 @@ struct style {
 	enum macro_bracket_style macro_bracket_style;
 };
 
+struct stored_diagnostic {
+	struct makel_diagnostic diagnostic; /* .text is not set */
+	size_t text_offset; /* In the list's .text */
+	enum warning_class class;
+	int queue; /* Only used in records */
+	size_t line; /* Only used in records */
+};
+
+struct diagnostic_list {
+	struct stored_diagnostic *diagnostics;
+	size_t count;
+	size_t size;
+	char *text;
+	size_t text_len;
+	size_t text_size;
+};
+
+/* A file that has been read through an include line, and its
+ * status when it was read, so that changes can be detected */
+struct include_dep {
+	const char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+/* The files being included, from the innermost */
+struct include_chain {
+	const char *path;
+	const struct include_chain *parent;
+};
+
+/* A name in a name table, its ID is its index in the table */
+struct name {
+	const char *str; /* Not NUL-terminated */
+	size_t len;
+	size_t hash;
+};
+
+struct name_table {
+	struct name *names;
+	size_t count;
+	size_t size;
+	size_t *slots; /* ID plus 1, or 0 if empty */
+	size_t nslots; /* A power of 2 */
+	struct name_block *blocks;
+};
+
+/* A macro that is defined or referenced, the paths are only
+ * NULL if the macro is not defined or referenced respectively */
+struct macro {
+	const char *name; /* Not NUL-terminated */
+	size_t len;
+	const char *def_path;
+	size_t def_line;
+	const char *ref_path;
+	size_t ref_line;
+};
+
+struct macro_table {
+	struct name_table names;
+	struct macro *macros; /* Indexed by the name's ID */
+	size_t count;
+	size_t size;
+	int incomplete; /* Set if an include line was not followed or a macro name is computed */
+};
+
+/* Flags in struct rule.flags */
+#define RULE_COMMANDS     0x01
+#define RULE_DOUBLE_COLON 0x02
 
-extern int exit_status;
-extern struct style style;
+/* A target rule or inference rule for one target, the
+ * targets of a rule line share the prerequisites */
+struct rule {
+	size_t target; /* Node ID */
+	size_t prereqs; /* Offset in .prereqs */
+	size_t nprereqs;
+	const char *path;
+	size_t line;
+	int flags;
+};
+
+/* The rules and nodes of a graph, as they are merged into
+ * another graph; see struct graph for the fields */
+struct rule_list {
+	const struct name *nodes;
+	size_t nnodes;
+	const struct rule *rules;
+	size_t nrules;
+	const size_t *prereqs;
+	size_t nprereqs;
+	size_t current;
+	int started;
+	int leading_commands;
+	int incomplete;
+	const char *first_path;
+	size_t first_line;
+};
+
+struct graph {
+	struct name_table nodes; /* Targets and prerequisites */
+	struct rule *rules; /* In the order they were read */
+	size_t nrules;
+	size_t rules_size;
+	size_t *prereqs; /* Node IDs */
+	size_t nprereqs;
+	size_t prereqs_size;
+	size_t current; /* The first rule of the last rule line, SIZE_MAX if command lines would not belong to it */
+	int started; /* Whether a line other than a command line has been read */
+	int leading_commands; /* Whether a command line was read before any other line */
+	int incomplete; /* Whether a target is not known, because its name uses a macro */
+	int checked_files; /* Whether the result depends on which files exist */
+	const char *first_path; /* The first non-comment line, NULL if none */
+	size_t first_line;
+};
+
+/* The diagnostics reported while checking each line of a file,
+ * so that they can be reused when the file is checked again;
+ * for each line they are stored in the order they were reported.
+ * Diagnostics from included files are not recorded, they are
+ * reported again when the include line is followed again, so a
+ * diagnostic's path is either NULL or the file's, which may have
+ * been freed since, so it is only compared against NULL */
+struct record {
+	struct diagnostic_list list;
+	size_t *line_start; /* Diagnostics for line i are .line_start[i] up to .line_start[i + 1] */
+	size_t nlines;
+};
+
+/* Used when a file is checked again after an edit */
+struct relint {
+	/* For each line, the line in the previous version if the
+	 * previous diagnostics can be reused, otherwise SIZE_MAX */
+	size_t *old_line;
+	const struct record *previous;
+	struct record *record; /* Where this check is recorded */
+};
+
+struct makel_snapshot {
+	int valid;
+	char *path;
+	struct style style;
+	enum action actions[NUM_WARNING_CLASS];
+	unsigned char *continued; /* Whether each line ended with a <backslash> */
+	struct record record;
+};
+
+/* Per-run state, nothing is shared between contexts */
+struct makel {
+	struct style style;
+	enum action actions[NUM_WARNING_CLASS];
+
+	makel_diagnostic_callback_t *callback;
+	void *user;
+
+	int exit_status;
+	int error; /* errno value if a diagnostic was lost, then the run fails */
+
+	char *buf; /* Where diagnostics are formatted */
+	size_t buf_size;
+
+	/* Diagnostics that shall be reported after all diagnostics that
+	 * have not been deferred, and after all diagnostics in queues
+	 * with lower indices; queue 0 means that diagnostics are
+	 * reported immediately, unless .capture is set */
+	int queue;
+	struct diagnostic_list deferred[3];
+	int capture; /* Keep diagnostics that are not deferred in .deferred[0] */
+
+	size_t jobs; /* The number of threads a file may be checked on */
+
+	struct stats *stats; /* NULL unless statistics shall be collected */
+
+	int follow_includes;
+	const char *include_dir; /* What include lines are relative to, NULL for the working directory */
+	const struct include_chain *include_chain; /* NULL unless an included file is being checked */
+	int followed_includes; /* Whether any include line was followed in the run */
+	int include_levels; /* The most levels of include lines followed from the file */
+	int include_limited; /* Whether an include line was not followed because of the files that include the file */
+	struct include_dep *deps; /* The files read through include lines in the run */
+	size_t ndeps;
+	size_t deps_size;
+
+	struct macro_table macros; /* The macros in the makefile and the files it includes */
+	struct graph graph; /* The rules in the makefile and the files it includes */
+
+	/* Only the first .max_warnings warnings (unless 0) in each class
+	 * are reported, the rest are only counted; .counts includes those
+	 * that are suppressed, .passed those that have been reported, or
+	 * would have been if not for the limit */
+	size_t max_warnings;
+	size_t counts[NUM_WARNING_CLASS];
+	size_t passed[NUM_WARNING_CLASS];
+
+	struct record *recording; /* Set while lines are checked, if they shall be recorded */
+	size_t line; /* The line being checked, if .recording is set */
+};
+
+
+/* diag.c */
+extern const struct warning_class_data warning_classes[];
+void init_context(struct makel *ctx);
+void destroy_context(struct makel *ctx);
+void report_warning_counts(struct makel *ctx);
+void report_included_diagnostics(struct makel *ctx, const struct diagnostic_list *list);
+void xprintwarningf(struct makel *ctx, enum warning_class class, int severity, const char *path,
+                    size_t first_line, size_t last_line, const char *fmt, ...);
+#define warnf_style(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_STYLE, __VA_ARGS__)
+#define warnf_confusing(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_CONFUSING, __VA_ARGS__)
+#define warnf_warning(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_WARNING, __VA_ARGS__)
+#define warnf_unspecified(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_UNSPECIFIED, __VA_ARGS__)
+#define warnf_nonconforming(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_NONCONFORMING, __VA_ARGS__)
+#define warnf_undefined(CTX, CLASS, ...) xprintwarningf(CTX, CLASS, EXIT_UNDEFINED, __VA_ARGS__)
+void printinfof(struct makel *ctx, enum warning_class class, const char *fmt, ...);
+void printtipf(struct makel *ctx, enum warning_class class, const char *fmt, ...);
+void defer_diagnostics(struct makel *ctx, int queue);
+void flush_deferred_diagnostics(struct makel *ctx);
+void report_captured_diagnostics(struct makel *ctx, struct makel *part, int queue);
+void replay_diagnostics(struct makel *ctx, const struct record *record, size_t old_line, const char *path);
+int finish_record(struct record *record, size_t nlines);
+void destroy_record(struct record *record);
 
 
 /* makefile.c */
-int open_default_makefile(const char **pathp);
-void cmdline_opt_f(const char *arg, const char **makefile_pathp);
-struct line *load_makefile(const char *path, size_t *nlinesp);
+int open_default_makefile(struct makel *ctx, const char **pathp);
+int is_default_makefile_name(const char *name);
+void cmdline_opt_f(struct makel *ctx, const char *arg, const char **makefile_pathp);
+int open_makefile(struct makel *ctx, const char **pathp);
+
+
+/* include.c */
+const char *get_include_dir(const char *path);
+int add_deps(struct makel *ctx, const struct include_dep *deps, size_t n);
+void begin_include_run(void);
+void end_include_run(void);
+size_t parse_include_line(const char *s, size_t len, int *optionalp);
+void follow_include_line(struct makel *ctx, struct file *file, size_t i);
+void prefetch_includes(struct makel *ctx, struct file *file);
+
+
+/* names.c */
+void clear_name_table(struct name_table *table);
+void destroy_name_table(struct name_table *table);
+size_t find_name(const struct name_table *table, const char *s, size_t len);
+size_t add_name(struct name_table *table, const char *s, size_t len);
+
+
+/* command.c */
+void init_command_scanner(struct command_scanner *scanner);
+void scan_command(struct command_scanner *scanner, const char *s, size_t n);
+
+
+/* macro.c */
+void clear_macro_table(struct macro_table *table);
+void destroy_macro_table(struct macro_table *table);
+size_t parse_macro_definition(const char *s, size_t len);
+void scan_macros(struct makel *ctx, struct file *file, size_t i, int warn);
+void merge_macros(struct makel *ctx, const struct macro *macros, size_t n);
+struct macro *export_macros(const struct macro_table *table);
+void report_macro_warnings(struct makel *ctx);
+
+
+/* graph.c */
+void clear_graph(struct graph *graph);
+void destroy_graph(struct graph *graph);
+void scan_rules(struct makel *ctx, struct file *file, size_t i);
+void merge_rules(struct makel *ctx, const struct rule_list *list);
+void get_rule_list(const struct graph *graph, struct rule_list *list);
+struct rule_list *export_rules(const struct graph *graph);
+void report_graph_warnings(struct makel *ctx);
+
+
+/* lint.c */
+int lint_file(struct makel *ctx, struct file *file, const struct relint *relint);
+int lint_stream(struct makel *ctx, struct text_stream *stream);
+
+
+/* batch.c */
+int lint_path_buffered(const char *path, char **textp, size_t *lenp);
+size_t default_job_count(void);
+int lint_batch(const char *const *paths, size_t npaths, size_t jobs, int *statuses);
+char **read_path_list(int fd, size_t *npathsp);
+
+
+/* walk.c */
+int lint_trees(const char *const *dirs, size_t ndirs, const char *const *files, size_t nfiles,
+               const char *const *patterns, size_t npatterns, size_t jobs);
+
+
+/* scan.c */
+size_t ascii_span(const char *s, size_t n);
+size_t find_newline_or_nul(const char *s, size_t n);
+size_t find_any_byte(const char *s, size_t n, const char *set);
+
+
+/* stats.c */
+extern int count_allocations;
+extern size_t allocation_count;
+void *counted_realloc(void *ptr, size_t n);
+void *counted_calloc(size_t n, size_t m);
+void *counted_malloc(size_t n);
+void end_phase(struct stats *stats, const struct timespec *start, enum phase phase, size_t lines, size_t bytes);
+void add_stats(struct stats *to, const struct stats *from);
 
 
 /* text.c */
-struct line *load_text_file(int fd, const char *fname, int nest_level, size_t *nlinesp);
-void check_utf8_encoding(struct line *line);
-void check_column_count(struct line *line);
-int is_line_blank(struct line *line);
+int load_text_file(struct makel *ctx, int fd, const char *fname, int nest_level, struct file *file);
+int load_text_buffer(struct makel *ctx, const void *data, size_t len, const char *fname,
+                     int nest_level, struct file *file);
+void unload_text_file(struct file *file);
+void open_text_stream(int fd, const char *fname, int nest_level, struct text_stream *stream);
+int read_text_line(struct makel *ctx, struct text_stream *stream);
+void drop_text_lines(struct text_stream *stream);
+void check_line_length(struct makel *ctx, struct file *file, size_t i);
+int merge_rewritten_lines(struct file *file, struct file *part);
+int check_utf8_encoding(struct makel *ctx, struct file *file, size_t i);
+void check_column_count(struct makel *ctx, struct file *file, size_t i);
+int is_line_blank(struct file *file, size_t i);
+void open_logical_line(struct logical_line *line, const struct file *file, size_t i);
+int next_span(struct logical_line *line, struct span *span);
+
+
+/* format.c */
+void end_machine_record(struct output *out);
+void print_machine_diagnostic(struct output *out, const struct makel_diagnostic *diagnostic);
+void print_machine_error(struct output *out, const char *path, const char *message);
+void print_sarif_header(const enum action actions[]);
+void print_sarif_footer(void);
+
+
+/* cache.c */
+extern const char *cache_dir;
+uint64_t hash_data(const void *data, size_t len, uint64_t seed);
+int lint_fd_cached(struct makel *ctx, int fd, const char *path, struct output *out);
+
+
+/* serve.c */
+int serve(const char *socket_path, size_t jobs);
+int lint_via_server(const char *socket_path, const char *path);
+
+
+/* watch.c */
+int watch_files(const char *const *paths, size_t npaths, size_t jobs);
 
 
 /* ui.c */
-extern struct warning_class_data warning_classes[];
-void xprintwarningf(enum warning_class class, int severity, const char *fmt, ...);
-#define warnf_style(CLASS, ...) xprintwarningf(CLASS, EXIT_STYLE, __VA_ARGS__)
-#define warnf_confusing(CLASS, ...) xprintwarningf(CLASS, EXIT_CONFUSING, __VA_ARGS__)
-#define warnf_warning(CLASS, ...) xprintwarningf(CLASS, EXIT_WARNING, __VA_ARGS__)
-#define warnf_unspecified(CLASS, ...) xprintwarningf(CLASS, EXIT_UNSPECIFIED, __VA_ARGS__)
-#define warnf_nonconforming(CLASS, ...) xprintwarningf(CLASS, EXIT_NONCONFORMING, __VA_ARGS__)
-#define warnf_undefined(CLASS, ...) xprintwarningf(CLASS, EXIT_UNDEFINED, __VA_ARGS__)
-void printinfof(enum warning_class class, const char *fmt, ...);
+extern enum output_format output_format;
+extern size_t max_warnings;
+extern int collect_stats;
+void init_cli_context(struct makel *ctx, struct output *out);
+void init_output(struct output *out, FILE *stream);
+void end_output(struct output *out);
+void destroy_output(struct output *out);
+void flush_output(void);
+void write_output(FILE *stream, const char *text, size_t len);
+void print_diagnostic(void *user, const struct makel_diagnostic *diagnostic);
+void print_file_error(struct output *out, const char *path, int err, const char *fmt, ...);
 void printerrorf(const char *fmt, ...);
-void printtipf(enum warning_class class, const char *fmt, ...);
+void destroy_cli_context(struct makel *ctx);
+void start_stats(void);
+void print_stats(void);
 
 
 /* util.c */
@@ -141,4 +637,5 @@ void *erealloc(void *, size_t);
 void *ecalloc(size_t, size_t);
 void *emalloc(size_t);
 void *ememdup(const void *, size_t);
+int writeall(int, const void *, size_t);
 void eprintf(const char *, ...);
@@ -1,8 +1,10 @@
 PREFIX    = /usr
 MANPREFIX = $(PREFIX)/share/man
 
-CC = c99
+CC      = c99
+LD      = ld
+OBJCOPY = objcopy
 
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_XOPEN_SOURCE=700 -D_GNU_SOURCE
 CFLAGS   = -Wall -g
-LDFLAGS  = -lgrapheme
+LDFLAGS  = -lgrapheme -lpthread
@@ -0,0 +1,411 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+const struct warning_class_data warning_classes[] = {
+#define X(ENUM, NAME, ACTION) {NAME, ACTION},
+	LIST_WARNING_CLASSES(X)
+#undef X
+	{NULL, 0}
+};
+
+
+void
+init_context(struct makel *ctx)
+{
+	size_t i;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->style.max_line_length = 120;
+	ctx->style.only_empty_blank_lines = 1;
+	ctx->style.macro_bracket_style = ROUND;
+	ctx->max_warnings = DEFAULT_MAX_WARNINGS;
+	ctx->follow_includes = 1;
+	ctx->graph.current = SIZE_MAX;
+	for (i = 0; i < NUM_WARNING_CLASS; i++)
+		ctx->actions[i] = warning_classes[i].action;
+}
+
+
+void
+destroy_context(struct makel *ctx)
+{
+	size_t i;
+
+	free(ctx->buf);
+	free(ctx->deps);
+	destroy_macro_table(&ctx->macros);
+	destroy_graph(&ctx->graph);
+	for (i = 0; i < ELEMSOF(ctx->deferred); i++) {
+		free(ctx->deferred[i].diagnostics);
+		free(ctx->deferred[i].text);
+	}
+}
+
+
+/* Returns the formatted text, or NULL (and ctx->error is set) on failure */
+static const char *
+vformat(struct makel *ctx, const char *fmt, va_list ap)
+{
+	va_list ap2;
+	size_t size;
+	char *new;
+	int r;
+
+	va_copy(ap2, ap);
+	r = vsnprintf(ctx->buf, ctx->buf_size, fmt, ap2);
+	va_end(ap2);
+	if (r < 0)
+		goto fail;
+
+	if ((size_t)r >= ctx->buf_size) {
+		size = MAX((size_t)r + 1, 2 * ctx->buf_size);
+		new = counted_realloc(ctx->buf, size);
+		if (!new)
+			goto fail;
+		ctx->buf = new;
+		ctx->buf_size = size;
+		vsnprintf(ctx->buf, ctx->buf_size, fmt, ap);
+	}
+	return ctx->buf;
+
+fail:
+	if (!ctx->error)
+		ctx->error = errno;
+	return NULL;
+}
+
+
+static int
+store_diagnostic(struct diagnostic_list *list, const struct makel_diagnostic *diagnostic,
+                 enum warning_class class, int queue, size_t line)
+{
+	struct stored_diagnostic *stored;
+	size_t len = strlen(diagnostic->text) + 1;
+	size_t size;
+	void *new;
+
+	if (list->count == list->size) {
+		size = list->size ? list->size * 2 : 16;
+		if (size > SIZE_MAX / sizeof(*list->diagnostics)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		new = counted_realloc(list->diagnostics, size * sizeof(*list->diagnostics));
+		if (!new)
+			return -1;
+		list->diagnostics = new;
+		list->size = size;
+	}
+
+	if (len > list->text_size - list->text_len) {
+		if (len > SIZE_MAX / 2 - list->text_len) {
+			errno = ENOMEM;
+			return -1;
+		}
+		size = MAX(2 * list->text_size, list->text_len + len);
+		new = counted_realloc(list->text, size);
+		if (!new)
+			return -1;
+		list->text = new;
+		list->text_size = size;
+	}
+
+	stored = &list->diagnostics[list->count++];
+	stored->diagnostic = *diagnostic;
+	stored->text_offset = list->text_len;
+	stored->class = class;
+	stored->queue = queue;
+	stored->line = line;
+	memcpy(&list->text[list->text_len], diagnostic->text, len);
+	list->text_len += len;
+	return 0;
+}
+
+
+/* Once the limit has been reached for a class, its warnings
+ * are suppressed, and so are the notes of those warnings */
+static int
+suppress(struct makel *ctx, const struct makel_diagnostic *diagnostic, enum warning_class class)
+{
+	if (!ctx->max_warnings)
+		return 0;
+	if (diagnostic->kind == MAKEL_WARNING)
+		return ctx->passed[class]++ >= ctx->max_warnings;
+	return ctx->passed[class] > ctx->max_warnings;
+}
+
+
+/* Whether a diagnostic will be suppressed, in which case it need
+ * not be formatted; but if lines are recorded, the record must
+ * include all diagnostics, as the limit may not be reached when
+ * the line is replayed */
+static int
+will_suppress(struct makel *ctx, enum makel_diagnostic_kind kind, enum warning_class class)
+{
+	if (!ctx->max_warnings || ctx->recording)
+		return 0;
+	if (kind == MAKEL_WARNING)
+		return ctx->passed[class] >= ctx->max_warnings;
+	return ctx->passed[class] > ctx->max_warnings;
+}
+
+
+static void
+report(struct makel *ctx, const struct makel_diagnostic *diagnostic, enum warning_class class)
+{
+	struct diagnostic_list *list = &ctx->deferred[ctx->queue];
+
+	if (ctx->recording && store_diagnostic(&ctx->recording->list, diagnostic, class, ctx->queue, ctx->line) &&
+	    !ctx->error)
+		ctx->error = errno;
+
+	if (!ctx->queue && suppress(ctx, diagnostic, class))
+		return;
+	if (ctx->queue || ctx->capture) {
+		if (store_diagnostic(list, diagnostic, class, 0, 0) && !ctx->error)
+			ctx->error = errno;
+	} else if (ctx->callback) {
+		ctx->callback(ctx->user, diagnostic);
+	}
+}
+
+
+void
+defer_diagnostics(struct makel *ctx, int queue)
+{
+	ctx->queue = queue;
+}
+
+
+void
+flush_deferred_diagnostics(struct makel *ctx)
+{
+	struct diagnostic_list *queue;
+	struct makel_diagnostic diagnostic;
+	size_t i, j;
+
+	ctx->queue = 0;
+	ctx->recording = NULL; /* Already recorded when deferred */
+	for (i = 1; i < ELEMSOF(ctx->deferred); i++) {
+		queue = &ctx->deferred[i];
+		for (j = 0; j < queue->count; j++) {
+			diagnostic = queue->diagnostics[j].diagnostic;
+			diagnostic.text = &queue->text[queue->diagnostics[j].text_offset];
+			report(ctx, &diagnostic, queue->diagnostics[j].class);
+		}
+		queue->count = 0;
+		queue->text_len = 0;
+	}
+}
+
+
+/* Reports, in order, the diagnostics that a context used to check
+ * part of a file has captured in one of its queues; each queue shall
+ * be reported for all parts before the next, for the diagnostics to
+ * be in the same order as if the whole file was checked at once */
+void
+report_captured_diagnostics(struct makel *ctx, struct makel *part, int queue)
+{
+	struct diagnostic_list *list = &part->deferred[queue];
+	struct makel_diagnostic diagnostic;
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		diagnostic = list->diagnostics[i].diagnostic;
+		diagnostic.text = &list->text[list->diagnostics[i].text_offset];
+		report(ctx, &diagnostic, list->diagnostics[i].class);
+	}
+}
+
+
+/* Reports the diagnostics that were captured when an included
+ * file was checked, as if they were found in the current line */
+void
+report_included_diagnostics(struct makel *ctx, const struct diagnostic_list *list)
+{
+	struct makel_diagnostic diagnostic;
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		diagnostic = list->diagnostics[i].diagnostic;
+		diagnostic.text = &list->text[list->diagnostics[i].text_offset];
+		if (diagnostic.kind == MAKEL_WARNING)
+			ctx->counts[list->diagnostics[i].class]++;
+		report(ctx, &diagnostic, list->diagnostics[i].class);
+	}
+}
+
+
+/* Reports, for the line being checked, the diagnostics recorded
+ * for a line that has not changed (but may have been moved); as
+ * only diagnostics about the file itself are recorded, they are
+ * reported with `path`, the file's path in this check */
+void
+replay_diagnostics(struct makel *ctx, const struct record *record, size_t old_line, const char *path)
+{
+	const struct stored_diagnostic *stored;
+	struct makel_diagnostic diagnostic;
+	size_t i;
+	int queue = ctx->queue;
+
+	for (i = record->line_start[old_line]; i < record->line_start[old_line + 1]; i++) {
+		stored = &record->list.diagnostics[i];
+		diagnostic = stored->diagnostic;
+		diagnostic.text = &record->list.text[stored->text_offset];
+		if (diagnostic.path) {
+			/* Lines referred to are in the same logical line, so
+			 * they have moved as much; no other file is referred to */
+			diagnostic.path = path;
+			diagnostic.first_line = diagnostic.first_line - old_line + ctx->line;
+			diagnostic.last_line = diagnostic.last_line - old_line + ctx->line;
+		}
+		ctx->exit_status = MAX(ctx->exit_status, diagnostic.severity);
+		if (diagnostic.kind == MAKEL_WARNING)
+			ctx->counts[stored->class]++;
+		ctx->queue = stored->queue;
+		report(ctx, &diagnostic, stored->class);
+	}
+	ctx->queue = queue;
+}
+
+
+/* Indexes the record by line once all lines have been checked */
+int
+finish_record(struct record *record, size_t nlines)
+{
+	size_t i, line;
+
+	free(record->line_start);
+	record->line_start = counted_malloc((nlines + 1) * sizeof(*record->line_start));
+	if (!record->line_start)
+		return -1;
+	record->nlines = nlines;
+
+	for (i = line = 0; line <= nlines; line++) {
+		while (i < record->list.count && record->list.diagnostics[i].line < line)
+			i++;
+		record->line_start[line] = i;
+	}
+	return 0;
+}
+
+
+void
+destroy_record(struct record *record)
+{
+	free(record->list.diagnostics);
+	free(record->list.text);
+	free(record->line_start);
+	memset(record, 0, sizeof(*record));
+}
+
+
+void
+xprintwarningf(struct makel *ctx, enum warning_class class, int severity, const char *path,
+               size_t first_line, size_t last_line, const char *fmt, ...)
+{
+	struct makel_diagnostic diagnostic;
+	va_list ap;
+
+	if (ctx->actions[class] == IGNORE)
+		return;
+	if (ctx->actions[class] != INFORM)
+		ctx->exit_status = MAX(ctx->exit_status, severity);
+
+	ctx->counts[class]++;
+	if (will_suppress(ctx, MAKEL_WARNING, class)) {
+		ctx->passed[class]++;
+		return;
+	}
+
+	va_start(ap, fmt);
+	diagnostic.text = vformat(ctx, fmt, ap);
+	va_end(ap);
+	if (!diagnostic.text)
+		return;
+
+	diagnostic.kind = MAKEL_WARNING;
+	diagnostic.class_name = warning_classes[class].name;
+	diagnostic.action = (enum makel_action)ctx->actions[class];
+	diagnostic.severity = ctx->actions[class] == INFORM ? 0 : severity;
+	diagnostic.path = path;
+	diagnostic.first_line = first_line;
+	diagnostic.last_line = last_line;
+	report(ctx, &diagnostic, class);
+}
+
+
+static void
+vprintnotef(struct makel *ctx, enum makel_diagnostic_kind kind, enum warning_class class, const char *fmt, va_list ap)
+{
+	struct makel_diagnostic diagnostic;
+
+	if (ctx->actions[class] == IGNORE || will_suppress(ctx, kind, class))
+		return;
+
+	diagnostic.text = vformat(ctx, fmt, ap);
+	if (!diagnostic.text)
+		return;
+
+	diagnostic.kind = kind;
+	diagnostic.class_name = warning_classes[class].name;
+	diagnostic.action = (enum makel_action)ctx->actions[class];
+	diagnostic.severity = 0;
+	diagnostic.path = NULL;
+	diagnostic.first_line = 0;
+	diagnostic.last_line = 0;
+	report(ctx, &diagnostic, class);
+}
+
+
+void
+printinfof(struct makel *ctx, enum warning_class class, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintnotef(ctx, MAKEL_INFO, class, fmt, ap);
+	va_end(ap);
+}
+
+
+void
+printtipf(struct makel *ctx, enum warning_class class, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintnotef(ctx, MAKEL_TIP, class, fmt, ap);
+	va_end(ap);
+}
+
+
+static void
+printcountf(struct makel *ctx, enum warning_class class, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintnotef(ctx, MAKEL_COUNT, class, fmt, ap);
+	va_end(ap);
+}
+
+
+/* Called at the end of a run; the number of warnings in each
+ * class that had any is reported, with the number of suppressed
+ * warnings if the class was limited */
+void
+report_warning_counts(struct makel *ctx)
+{
+	size_t i, max = ctx->max_warnings;
+
+	ctx->max_warnings = 0; /* These must not be suppressed */
+	for (i = 0; i < NUM_WARNING_CLASS; i++) {
+		if (!ctx->counts[i])
+			continue;
+		if (max && ctx->counts[i] > max)
+			printcountf(ctx, (enum warning_class)i, "-w%s: %zu in total, %zu suppressed",
+			            warning_classes[i].name, ctx->counts[i], ctx->counts[i] - max);
+		else
+			printcountf(ctx, (enum warning_class)i, "-w%s: %zu in total", warning_classes[i].name, ctx->counts[i]);
+	}
+	ctx->max_warnings = max;
+}
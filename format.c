@@ -0,0 +1,327 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* The machine-readable output formats: JSON Lines, with one object
+ * per diagnostic, and SARIF 2.1.0, where all diagnostics are results
+ * in one document. Info and tip diagnostics are attached as notes to
+ * the warning before them, if it is in the same class, so a warning
+ * is kept in struct output.record until the next diagnostic that is
+ * not one of its notes, or end_output(), and then printed at once.
+ * The number of warnings in each class, reported at the end of a
+ * run, is never a note, but a record of the kind "count".
+ * The SARIF document is printed as it goes, each result is preceded
+ * by a comma that write_output() removes from the first result */
+
+
+static const char *const severity_names[] = {
+	[0]                  = "none",
+	[EXIT_STYLE]         = "style",
+	[EXIT_CONFUSING]     = "confusing",
+	[EXIT_WARNING]       = "warning",
+	[EXIT_UNSPECIFIED]   = "unspecified",
+	[EXIT_NONCONFORMING] = "nonconforming",
+	[EXIT_UNDEFINED]     = "undefined"
+};
+
+
+static void
+append(struct output *out, const char *s, size_t n)
+{
+	size_t size;
+
+	if (n > out->record_size - out->record_len) {
+		size = MAX(2 * out->record_size, out->record_len + n);
+		out->record = erealloc(out->record, size);
+		out->record_size = size;
+	}
+	memcpy(&out->record[out->record_len], s, n);
+	out->record_len += n;
+}
+
+
+static void
+append_str(struct output *out, const char *s)
+{
+	append(out, s, strlen(s));
+}
+
+
+static void
+append_size(struct output *out, size_t n)
+{
+	char buf[3 * sizeof(n) + 1];
+	append(out, buf, (size_t)sprintf(buf, "%zu", n));
+}
+
+
+/* JSON text must be valid UTF-8, so invalid UTF-8 in, for example,
+ * a path is replaced with the Unicode replacement character */
+static void
+append_json_string(struct output *out, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t off, r, len = strlen(s);
+	uint_least32_t codepoint;
+	unsigned char c;
+	char esc[6];
+
+	append(out, "\"", 1);
+	for (off = 0; off < len; off += r) {
+		for (r = 0; off + r < len; r++) {
+			c = (unsigned char)s[off + r];
+			if (c < ' ' || c >= 0x80 || c == '"' || c == '\\')
+				break;
+		}
+		if (r) {
+			append(out, &s[off], r);
+		} else if (s[off] == '"' || s[off] == '\\') {
+			esc[0] = '\\';
+			esc[1] = s[off];
+			append(out, esc, 2);
+			r = 1;
+		} else if ((unsigned char)s[off] < ' ') {
+			memcpy(esc, "\\u00", 4);
+			esc[4] = hex[(unsigned char)s[off] >> 4];
+			esc[5] = hex[(unsigned char)s[off] & 15];
+			append(out, esc, 6);
+			r = 1;
+		} else {
+			r = grapheme_decode_utf8(&s[off], len - off, &codepoint);
+			if (r > len - off) /* Sequence truncated by the end of the string */
+				r = len - off;
+			if (codepoint == GRAPHEME_INVALID_CODEPOINT)
+				append_str(out, "\\ufffd");
+			else
+				append(out, &s[off], r);
+		}
+	}
+	append(out, "\"", 1);
+}
+
+
+/* A path is a relative reference, or an absolute path, in a
+ * URI, so everything but unreserved characters and <slash>
+ * is percent-encoded; it is also a valid JSON string */
+static void
+append_uri(struct output *out, const char *path)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned char c;
+	char esc[3];
+
+	append(out, "\"", 1);
+	for (; *path; path++) {
+		c = (unsigned char)*path;
+		if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~/", c)) {
+			append(out, path, 1);
+		} else {
+			esc[0] = '%';
+			esc[1] = hex[c >> 4];
+			esc[2] = hex[c & 15];
+			append(out, esc, 3);
+		}
+	}
+	append(out, "\"", 1);
+}
+
+
+static const char *
+note_kind(const struct makel_diagnostic *diagnostic)
+{
+	return diagnostic->kind == MAKEL_TIP ? "tip" : diagnostic->kind == MAKEL_COUNT ? "count" : "info";
+}
+
+
+static const char *
+sarif_level(const struct makel_diagnostic *diagnostic)
+{
+	if (diagnostic->action == MAKEL_INFORM)
+		return "note";
+	return diagnostic->severity >= EXIT_UNSPECIFIED ? "error" : "warning";
+}
+
+
+static void
+append_location(struct output *out, const char *path, size_t first_line, size_t last_line)
+{
+	append_str(out, ",\"locations\":[{\"physicalLocation\":{\"artifactLocation\":{\"uri\":");
+	append_uri(out, path);
+	append_str(out, "}");
+	if (first_line) {
+		append_str(out, ",\"region\":{\"startLine\":");
+		append_size(out, first_line);
+		append_str(out, ",\"endLine\":");
+		append_size(out, last_line);
+		append_str(out, "}");
+	}
+	append_str(out, "}}]");
+}
+
+
+static void
+begin_jsonl_record(struct output *out, const struct makel_diagnostic *diagnostic)
+{
+	if (diagnostic->kind != MAKEL_WARNING) {
+		append_str(out, "{\"kind\":\"");
+		append_str(out, note_kind(diagnostic));
+		append_str(out, "\",\"class\":");
+		append_json_string(out, diagnostic->class_name);
+		append_str(out, ",\"message\":");
+		append_json_string(out, diagnostic->text);
+		return;
+	}
+
+	append_str(out, "{\"kind\":\"warning\",\"class\":");
+	append_json_string(out, diagnostic->class_name);
+	append_str(out, diagnostic->action == MAKEL_INFORM ? ",\"action\":\"inform\"" :
+	                diagnostic->action == MAKEL_WARN_STYLE ? ",\"action\":\"style\"" : ",\"action\":\"warn\"");
+	append_str(out, ",\"severity\":");
+	append_size(out, (size_t)diagnostic->severity);
+	append_str(out, ",\"severity_name\":\"");
+	append_str(out, severity_names[diagnostic->severity]);
+	append_str(out, "\"");
+	if (diagnostic->path) {
+		append_str(out, ",\"path\":");
+		append_json_string(out, diagnostic->path);
+		if (diagnostic->first_line) {
+			append_str(out, ",\"first_line\":");
+			append_size(out, diagnostic->first_line);
+			append_str(out, ",\"last_line\":");
+			append_size(out, diagnostic->last_line);
+		}
+	}
+	append_str(out, ",\"message\":");
+	append_json_string(out, diagnostic->text);
+}
+
+
+static void
+begin_sarif_result(struct output *out, const struct makel_diagnostic *diagnostic)
+{
+	append_str(out, ",{\"ruleId\":");
+	append_json_string(out, diagnostic->class_name);
+	if (diagnostic->kind != MAKEL_WARNING) {
+		append_str(out, ",\"kind\":\"informational\",\"level\":\"none\",\"message\":{\"text\":");
+		append_json_string(out, diagnostic->text);
+		append_str(out, "},\"properties\":{\"kind\":\"");
+		append_str(out, note_kind(diagnostic));
+		append_str(out, "\"");
+		return;
+	}
+
+	append_str(out, ",\"level\":\"");
+	append_str(out, sarif_level(diagnostic));
+	append_str(out, "\",\"message\":{\"text\":");
+	append_json_string(out, diagnostic->text);
+	append_str(out, "}");
+	if (diagnostic->path)
+		append_location(out, diagnostic->path, diagnostic->first_line, diagnostic->last_line);
+	append_str(out, ",\"properties\":{\"severity\":");
+	append_size(out, (size_t)diagnostic->severity);
+	append_str(out, ",\"severityName\":\"");
+	append_str(out, severity_names[diagnostic->severity]);
+	append_str(out, "\"");
+}
+
+
+static void
+add_note(struct output *out, const struct makel_diagnostic *diagnostic)
+{
+	append_str(out, out->nnotes++ ? ",{\"kind\":\"" : ",\"notes\":[{\"kind\":\"");
+	append_str(out, note_kind(diagnostic));
+	append_str(out, output_format == FORMAT_SARIF ? "\",\"text\":" : "\",\"message\":");
+	append_json_string(out, diagnostic->text);
+	append_str(out, "}");
+}
+
+
+void
+end_machine_record(struct output *out)
+{
+	if (!out->record_len)
+		return;
+	if (out->nnotes)
+		append_str(out, "]");
+	append_str(out, output_format == FORMAT_SARIF ? "}}\n" : "}\n");
+	write_output(out->stream, out->record, out->record_len);
+	out->record_len = 0;
+	out->class_name = NULL;
+	out->nnotes = 0;
+}
+
+
+void
+print_machine_diagnostic(struct output *out, const struct makel_diagnostic *diagnostic)
+{
+	if ((diagnostic->kind == MAKEL_INFO || diagnostic->kind == MAKEL_TIP) && out->class_name &&
+	    !strcmp(diagnostic->class_name, out->class_name)) {
+		add_note(out, diagnostic);
+		return;
+	}
+
+	end_machine_record(out);
+	if (output_format == FORMAT_SARIF)
+		begin_sarif_result(out, diagnostic);
+	else
+		begin_jsonl_record(out, diagnostic);
+
+	/* Notes can only be attached to warnings */
+	if (diagnostic->kind == MAKEL_WARNING)
+		out->class_name = diagnostic->class_name;
+	else
+		end_machine_record(out);
+}
+
+
+void
+print_machine_error(struct output *out, const char *path, const char *message)
+{
+	end_machine_record(out);
+	if (output_format == FORMAT_SARIF) {
+		append_str(out, ",{\"level\":\"error\",\"message\":{\"text\":");
+		append_json_string(out, message);
+		append_str(out, "}");
+		append_location(out, path, 0, 0);
+		append_str(out, ",\"properties\":{\"kind\":\"error\"");
+	} else {
+		append_str(out, "{\"kind\":\"error\",\"path\":");
+		append_json_string(out, path);
+		append_str(out, ",\"message\":");
+		append_json_string(out, message);
+	}
+	end_machine_record(out);
+}
+
+
+/* The rules are taken from the table of warning classes, with the
+ * configured action of each class as its default configuration */
+void
+print_sarif_header(const enum action actions[])
+{
+	struct output out;
+	size_t i;
+
+	init_output(&out, stderr);
+	append_str(&out, "{\"$schema\":\"https://json.schemastore.org/sarif-2.1.0.json\",\"version\":\"2.1.0\","
+	                 "\"runs\":[{\"tool\":{\"driver\":{\"name\":\"makel\",\"rules\":[");
+	for (i = 0; i < NUM_WARNING_CLASS; i++) {
+		append_str(&out, i ? ",{\"id\":" : "{\"id\":");
+		append_json_string(&out, warning_classes[i].name);
+		append_str(&out, ",\"defaultConfiguration\":{");
+		append_str(&out, actions[i] == IGNORE ? "\"enabled\":false" :
+		                 actions[i] == INFORM ? "\"level\":\"note\"" : "\"level\":\"warning\"");
+		append_str(&out, "}}");
+	}
+	append_str(&out, "]}},\"results\":[\n");
+	write_output(stderr, out.record, out.record_len);
+	out.record_len = 0;
+	destroy_output(&out);
+}
+
+
+void
+print_sarif_footer(void)
+{
+	write_output(stderr, "]}]}\n", 5);
+}
@@ -0,0 +1,981 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* The rules of a makefile, and the files it includes, are recorded
+ * as they are read, with each target and prerequisite as a node ID
+ * in the graph's name table; a rule line with several targets is
+ * recorded as one rule for each target, sharing the prerequisites.
+ * Nothing is checked until the end of the run, when the rules are
+ * known, so that the result does not depend on which lines were
+ * checked again after an edit. Targets and prerequisites whose
+ * names use macros are skipped, as we do not expand macros.
+ *
+ * The dependency graph is built from the rules as arrays indexed by
+ * node ID, and its strongly connected components are found with
+ * Tarjan's algorithm, with an explicit stack, as the graph of a
+ * generated makefile can be much deeper than the call stack. */
+
+
+/* Suffixes that are in .SUFFIXES by default */
+static const char *const default_suffixes[] = {
+	".o", ".c", ".y", ".l", ".a", ".sh", ".f", ".c~", ".y~", ".l~", ".sh~", ".f~"
+};
+
+/* The default inference rules, as source and target suffix, the
+ * target suffix is "" for single-suffix rules */
+static const char *const default_inference_rules[][2] = {
+	{".c", ""}, {".f", ""}, {".sh", ""}, {".c~", ""}, {".f~", ""}, {".sh~", ""},
+	{".c", ".o"}, {".f", ".o"}, {".y", ".o"}, {".l", ".o"}, {".y", ".c"}, {".l", ".c"},
+	{".c", ".a"}, {".f", ".a"}, {".c~", ".o"}, {".f~", ".o"}, {".y~", ".o"}, {".l~", ".o"},
+	{".y~", ".c"}, {".l~", ".c"}, {".c~", ".c"}, {".f~", ".f"}, {".y~", ".y"}, {".l~", ".l"},
+	{".sh~", ".sh"}, {".c~", ".a"}, {".f~", ".a"}
+};
+
+static const char *const special_targets[] = {
+	".DEFAULT", ".IGNORE", ".NOTPARALLEL", ".PHONY", ".POSIX", ".PRECIOUS",
+	".SCCS_GET", ".SILENT", ".SUFFIXES", ".WAIT"
+};
+
+/* What a node is, in struct graph_check.kinds */
+#define NODE_SPECIAL   0x01
+#define NODE_INFERENCE 0x02
+#define NODE_SUFFIX    0x04
+#define NODE_PHONY     0x08
+#define NODE_ON_STACK  0x10
+
+/* An inference rule, the target suffix is empty for a single-suffix rule */
+struct inference_rule {
+	const char *src;
+	size_t src_len;
+	const char *dst;
+	size_t dst_len;
+};
+
+struct directory {
+	struct name_table entries;
+	int readable;
+};
+
+/* Only used at the end of the run */
+struct graph_check {
+	unsigned char *kinds;
+	size_t *first_rule;    /* The first rule for each node, SIZE_MAX if none */
+	size_t *commands_rule; /* The first rule with commands for each node, SIZE_MAX if none */
+	size_t *first_use;     /* The first rule with the node as a prerequisite, SIZE_MAX if none */
+	size_t *edge_start;    /* The edges from node i are .edges[.edge_start[i]] up to .edges[.edge_start[i + 1]] */
+	size_t *edges;
+	size_t default_rule;   /* The .DEFAULT rule, SIZE_MAX if none */
+	size_t posix_rule;     /* The first .POSIX rule, SIZE_MAX if none */
+	size_t wait;           /* The node of .WAIT, SIZE_MAX if none */
+	struct inference_rule *inference_rules;
+	size_t ninference_rules;
+	size_t inference_rules_size;
+	struct name_table directory_names;
+	struct directory *directories; /* Indexed by the name's ID */
+	size_t ndirectories;
+	size_t directories_size;
+};
+
+
+void
+clear_graph(struct graph *graph)
+{
+	clear_name_table(&graph->nodes);
+	graph->nrules = 0;
+	graph->nprereqs = 0;
+	graph->current = SIZE_MAX;
+	graph->started = 0;
+	graph->leading_commands = 0;
+	graph->incomplete = 0;
+	graph->checked_files = 0;
+	graph->first_path = NULL;
+	graph->first_line = 0;
+}
+
+
+void
+destroy_graph(struct graph *graph)
+{
+	destroy_name_table(&graph->nodes);
+	free(graph->rules);
+	free(graph->prereqs);
+}
+
+
+/* Returns the node ID, or SIZE_MAX (and ctx->error is set) on failure */
+static size_t
+add_node(struct makel *ctx, const char *name, size_t len)
+{
+	size_t id = add_name(&ctx->graph.nodes, name, len);
+	if (id == SIZE_MAX && !ctx->error)
+		ctx->error = errno;
+	return id;
+}
+
+
+static int
+add_rule(struct makel *ctx, size_t target, const char *path, size_t line)
+{
+	struct graph *graph = &ctx->graph;
+	struct rule *rule;
+	size_t size;
+	void *new;
+
+	if (graph->nrules == graph->rules_size) {
+		size = graph->rules_size ? graph->rules_size * 2 : 64;
+		new = counted_realloc(graph->rules, size * sizeof(*graph->rules));
+		if (!new)
+			goto fail;
+		graph->rules = new;
+		graph->rules_size = size;
+	}
+	rule = &graph->rules[graph->nrules++];
+	rule->target = target;
+	rule->prereqs = graph->nprereqs;
+	rule->nprereqs = 0;
+	rule->path = path;
+	rule->line = line;
+	rule->flags = 0;
+	return 0;
+
+fail:
+	if (!ctx->error)
+		ctx->error = errno;
+	return -1;
+}
+
+
+static int
+add_prereq(struct makel *ctx, size_t node)
+{
+	struct graph *graph = &ctx->graph;
+	size_t size;
+	void *new;
+
+	if (graph->nprereqs == graph->prereqs_size) {
+		size = graph->prereqs_size ? graph->prereqs_size * 2 : 256;
+		new = counted_realloc(graph->prereqs, size * sizeof(*graph->prereqs));
+		if (!new) {
+			if (!ctx->error)
+				ctx->error = errno;
+			return -1;
+		}
+		graph->prereqs = new;
+		graph->prereqs_size = size;
+	}
+	graph->prereqs[graph->nprereqs++] = node;
+	return 0;
+}
+
+
+/* Returns the end of a target or prerequisite beginning at s[start],
+ * in which a macro expansion can contain delimiters; *computedp is
+ * set if the name uses a macro */
+static size_t
+find_word_end(const char *s, size_t len, size_t start, int in_prereqs, int *computedp)
+{
+	size_t j, depth = 0;
+
+	*computedp = 0;
+	for (j = start; j < len; j++) {
+		if (s[j] == '$' && j + 1 < len) {
+			*computedp = 1;
+			if (s[j + 1] == '(' || s[j + 1] == '{')
+				depth++;
+			j++;
+		} else if (depth) {
+			depth -= (s[j] == ')' || s[j] == '}');
+		} else if (isblank(s[j]) || s[j] == '#' || s[j] == (in_prereqs ? ';' : ':')) {
+			break;
+		}
+	}
+	return j;
+}
+
+
+/* Records a target rule (or inference rule), that begins at line i,
+ * its targets are recorded first, and its prerequisites once they
+ * are known; if there is no <colon>, the line is not a rule */
+static void
+scan_rule(struct makel *ctx, struct file *file, size_t i)
+{
+	struct graph *graph = &ctx->graph;
+	size_t first_rule = graph->nrules, first_prereq = graph->nprereqs, line = LINE_NUMBER(file, i);
+	size_t j, start, len, node, r;
+	int in_prereqs = 0, flags = 0, computed, incomplete = 0;
+	struct logical_line logical;
+	struct span span;
+	const char *s;
+
+	open_logical_line(&logical, file, i);
+	while (next_span(&logical, &span)) {
+		s = span.s;
+		len = span.len;
+		for (j = 0; j < len;) {
+			if (isblank(s[j])) {
+				j++;
+				continue;
+			} else if (s[j] == '#') {
+				goto out;
+			} else if (!in_prereqs && s[j] == ':') {
+				in_prereqs = 1;
+				if (++j < len && s[j] == ':') {
+					flags |= RULE_DOUBLE_COLON;
+					j++;
+				}
+				continue;
+			} else if (in_prereqs && s[j] == ';') {
+				flags |= RULE_COMMANDS;
+				goto out;
+			}
+
+			start = j;
+			j = find_word_end(s, len, start, in_prereqs, &computed);
+			if (computed) {
+				incomplete |= !in_prereqs;
+				continue;
+			}
+			/* Pattern rules are not standard, but what they can make is unknown */
+			incomplete |= !in_prereqs && memchr(&s[start], '%', j - start) != NULL;
+			node = add_node(ctx, &s[start], j - start);
+			if (node == SIZE_MAX)
+				return;
+			if (in_prereqs ? add_prereq(ctx, node) : add_rule(ctx, node, file->path, line))
+				return;
+		}
+	}
+
+out:
+	if (!in_prereqs) {
+		/* Not a rule after all */
+		graph->nrules = first_rule;
+		graph->nprereqs = first_prereq;
+		return;
+	}
+	graph->incomplete |= incomplete;
+	for (r = first_rule; r < graph->nrules; r++) {
+		graph->rules[r].nprereqs = graph->nprereqs - first_prereq;
+		graph->rules[r].flags = flags;
+	}
+	graph->current = first_rule;
+}
+
+
+/* Records the rule in a logical line, that begins at line i, or the
+ * commands of the last rule if it is a command line; unlike the other
+ * checks of a logical line, this does not depend on how it is classified,
+ * as it is also done for lines whose diagnostics are replayed */
+void
+scan_rules(struct makel *ctx, struct file *file, size_t i)
+{
+	struct graph *graph = &ctx->graph;
+	const char *data = LINE_DATA(file, i), *s = data, *end = &data[file->lengths[i]];
+	size_t r;
+	int optional;
+
+	while (s != end && isspace(*s))
+		s++;
+	if (s == end || *s == '#')
+		return;
+
+	if (!graph->first_path) {
+		graph->first_path = file->path;
+		graph->first_line = LINE_NUMBER(file, i);
+	}
+
+	if (data[0] == '\t') {
+		if (graph->current != SIZE_MAX) {
+			for (r = graph->current; r < graph->nrules; r++)
+				graph->rules[r].flags |= RULE_COMMANDS;
+		} else if (!graph->started) {
+			graph->leading_commands = 1;
+		}
+		return;
+	}
+
+	graph->started = 1;
+	graph->current = SIZE_MAX;
+	if (parse_macro_definition(s, (size_t)(end - s)) || parse_include_line(s, (size_t)(end - s), &optional))
+		return;
+	scan_rule(ctx, file, i);
+}
+
+
+/* Adds the rules from another graph, for later lines or for an
+ * included file; commands at the beginning of the other graph
+ * belong to the last rule in this graph */
+void
+merge_rules(struct makel *ctx, const struct rule_list *list)
+{
+	struct graph *graph = &ctx->graph;
+	const struct rule *rule;
+	size_t *ids, i, j, prereqs = graph->nprereqs;
+
+	if (list->leading_commands && graph->current != SIZE_MAX)
+		for (i = graph->current; i < graph->nrules; i++)
+			graph->rules[i].flags |= RULE_COMMANDS;
+
+	ids = counted_malloc((list->nnodes ? list->nnodes : 1) * sizeof(*ids));
+	if (!ids) {
+		if (!ctx->error)
+			ctx->error = errno;
+		return;
+	}
+	for (i = 0; i < list->nnodes; i++) {
+		ids[i] = add_node(ctx, list->nodes[i].str, list->nodes[i].len);
+		if (ids[i] == SIZE_MAX)
+			goto out;
+	}
+	for (i = 0; i < list->nrules; i++) {
+		rule = &list->rules[i];
+		/* Rules on the same line share their prerequisites */
+		if (!i || rule->prereqs != list->rules[i - 1].prereqs || rule->path != list->rules[i - 1].path ||
+		    rule->line != list->rules[i - 1].line) {
+			prereqs = graph->nprereqs;
+			for (j = 0; j < rule->nprereqs; j++)
+				if (add_prereq(ctx, ids[list->prereqs[rule->prereqs + j]]))
+					goto out;
+		}
+		if (add_rule(ctx, ids[rule->target], rule->path, rule->line))
+			goto out;
+		graph->rules[graph->nrules - 1].prereqs = prereqs;
+		graph->rules[graph->nrules - 1].nprereqs = rule->nprereqs;
+		graph->rules[graph->nrules - 1].flags = rule->flags;
+	}
+
+	if (list->started)
+		graph->current = list->current == SIZE_MAX ? SIZE_MAX : list->current - list->nrules + graph->nrules;
+	graph->started |= list->started;
+	graph->incomplete |= list->incomplete;
+	if (!graph->first_path) {
+		graph->first_path = list->first_path;
+		graph->first_line = list->first_line;
+	}
+
+out:
+	free(ids);
+}
+
+
+/* Returns a view of a graph, which is only valid as long as the graph is not changed */
+void
+get_rule_list(const struct graph *graph, struct rule_list *list)
+{
+	list->nodes = graph->nodes.names;
+	list->nnodes = graph->nodes.count;
+	list->rules = graph->rules;
+	list->nrules = graph->nrules;
+	list->prereqs = graph->prereqs;
+	list->nprereqs = graph->nprereqs;
+	list->current = graph->current;
+	list->started = graph->started;
+	list->leading_commands = graph->leading_commands;
+	list->incomplete = graph->incomplete;
+	list->first_path = graph->first_path;
+	list->first_line = graph->first_line;
+}
+
+
+/* Returns a copy of the rules, in one allocation with the names, so
+ * that they outlive the graph, or NULL on failure; the paths must also
+ * outlive the graph, as they are not copied */
+struct rule_list *
+export_rules(const struct graph *graph)
+{
+	struct rule_list *list;
+	struct name *nodes;
+	struct rule *rules;
+	size_t i, names_size = 0, *prereqs;
+	char *p;
+
+	for (i = 0; i < graph->nodes.count; i++)
+		names_size += graph->nodes.names[i].len;
+	list = counted_malloc(sizeof(*list) + graph->nodes.count * sizeof(*list->nodes) +
+	              graph->nrules * sizeof(*list->rules) + graph->nprereqs * sizeof(*list->prereqs) + names_size);
+	if (!list)
+		return NULL;
+	get_rule_list(graph, list);
+	/* The rules are not continued by the includer's command lines */
+	list->current = SIZE_MAX;
+
+	nodes = (struct name *)&list[1];
+	rules = (struct rule *)&nodes[graph->nodes.count];
+	prereqs = (size_t *)&rules[graph->nrules];
+	/* The arrays are NULL if empty, which memcpy() must not be given */
+	if (graph->nrules)
+		memcpy(rules, graph->rules, graph->nrules * sizeof(*graph->rules));
+	if (graph->nprereqs)
+		memcpy(prereqs, graph->prereqs, graph->nprereqs * sizeof(*graph->prereqs));
+	p = (char *)&prereqs[graph->nprereqs];
+	for (i = 0; i < graph->nodes.count; i++) {
+		nodes[i] = graph->nodes.names[i];
+		nodes[i].str = memcpy(p, graph->nodes.names[i].str, graph->nodes.names[i].len);
+		p += graph->nodes.names[i].len;
+	}
+	list->nodes = nodes;
+	list->rules = rules;
+	list->prereqs = prereqs;
+	return list;
+}
+
+
+static int
+is_name(const struct name *name, const char *s, size_t len)
+{
+	return name->len == len && !memcmp(name->str, s, len);
+}
+
+
+static int
+is_suffix(const struct graph *graph, const struct graph_check *check, const char *s, size_t len)
+{
+	size_t node = find_name(&graph->nodes, s, len);
+	return node != SIZE_MAX && (check->kinds[node] & NODE_SUFFIX);
+}
+
+
+/* Returns the length of the source suffix if a target is the name
+ * of an inference rule, that is, one or two known suffixes, 0 if not */
+static size_t
+get_inference_rule(const struct graph *graph, const struct graph_check *check, const struct name *name)
+{
+	size_t k;
+
+	if (name->len < 2 || name->str[0] != '.' || memchr(name->str, '/', name->len))
+		return 0;
+	if (is_suffix(graph, check, name->str, name->len))
+		return name->len;
+	for (k = 2; k < name->len; k++)
+		if (name->str[k] == '.' && is_suffix(graph, check, name->str, k) &&
+		    is_suffix(graph, check, &name->str[k], name->len - k))
+			return k;
+	return 0;
+}
+
+
+/* Reads the names in a directory, or marks it as unreadable */
+static void
+read_directory(struct directory *d, const char *path)
+{
+	DIR *dir;
+	struct dirent *f;
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((f = readdir(dir)))
+		if (add_name(&d->entries, f->d_name, strlen(f->d_name)) == SIZE_MAX)
+			break;
+	/* If it could not be read completely, the files are looked up one by one */
+	d->readable = !f;
+	closedir(dir);
+}
+
+
+/* Returns the directory, which is read the first time, or NULL on failure */
+static struct directory *
+get_directory(struct graph_check *check, const char *path)
+{
+	size_t id, size;
+	void *new;
+
+	id = add_name(&check->directory_names, path, strlen(path));
+	if (id == SIZE_MAX)
+		return NULL;
+	if (id < check->ndirectories)
+		return &check->directories[id];
+	if (check->ndirectories == check->directories_size) {
+		size = check->directories_size ? check->directories_size * 2 : 8;
+		new = counted_realloc(check->directories, size * sizeof(*check->directories));
+		if (!new)
+			return NULL;
+		check->directories = new;
+		check->directories_size = size;
+	}
+	memset(&check->directories[id], 0, sizeof(check->directories[id]));
+	check->ndirectories += 1;
+	read_directory(&check->directories[id], path);
+	return &check->directories[id];
+}
+
+
+/* Files are looked up in a listing of their directory, as there can be
+ * millions of them, and each can be looked up with many suffixes */
+static int
+file_exists(struct makel *ctx, struct graph_check *check, const char *name, size_t len,
+            const char *suffix, size_t suffix_len)
+{
+	const char *dir = ctx->include_dir, *base;
+	struct directory *d;
+	struct stat st;
+	size_t dirlen = dir && name[0] != '/' ? strlen(dir) + 1 : 0;
+	char *path, *slash;
+	int r;
+
+	ctx->graph.checked_files = 1;
+	path = counted_malloc(dirlen + len + suffix_len + 3);
+	if (!path)
+		return 1; /* Rather a missed warning than a false one */
+	if (dirlen) {
+		memcpy(path, dir, dirlen - 1);
+		path[dirlen - 1] = '/';
+	}
+	memcpy(&path[dirlen], name, len);
+	memcpy(&path[dirlen + len], suffix, suffix_len);
+	path[dirlen + len + suffix_len] = '\0';
+
+	slash = strrchr(path, '/');
+	base = slash ? &slash[1] : path;
+	if (!*base) {
+		d = NULL;
+	} else if (!slash) {
+		d = get_directory(check, ".");
+	} else if (slash == path) {
+		d = get_directory(check, "/");
+	} else {
+		*slash = '\0';
+		d = get_directory(check, path);
+		*slash = '/';
+	}
+	if (d && d->readable)
+		r = find_name(&d->entries, base, strlen(base)) != SIZE_MAX;
+	else
+		r = !stat(path, &st);
+	free(path);
+	return r;
+}
+
+
+/* Whether make(1) could make a prerequisite that has no target rule,
+ * because it exists, or an inference rule can make it from a file
+ * that exists; inference rules are not chained */
+static int
+can_make(struct makel *ctx, struct graph_check *check, const struct name *name)
+{
+	const struct inference_rule *rule;
+	size_t i;
+
+	if (file_exists(ctx, check, name->str, name->len, "", 0))
+		return 1;
+	for (i = 0; i < check->ninference_rules; i++) {
+		rule = &check->inference_rules[i];
+		if (name->len > rule->dst_len && !memcmp(&name->str[name->len - rule->dst_len], rule->dst, rule->dst_len) &&
+		    file_exists(ctx, check, name->str, name->len - rule->dst_len, rule->src, rule->src_len))
+			return 1;
+	}
+	return 0;
+}
+
+
+static int
+add_inference_rule(struct makel *ctx, struct graph_check *check, const char *src, size_t src_len,
+                   const char *dst, size_t dst_len)
+{
+	struct inference_rule *rule;
+	size_t size;
+	void *new;
+
+	if (check->ninference_rules == check->inference_rules_size) {
+		size = check->inference_rules_size ? check->inference_rules_size * 2 : ELEMSOF(default_inference_rules);
+		new = counted_realloc(check->inference_rules, size * sizeof(*check->inference_rules));
+		if (!new) {
+			if (!ctx->error)
+				ctx->error = errno;
+			return -1;
+		}
+		check->inference_rules = new;
+		check->inference_rules_size = size;
+	}
+	rule = &check->inference_rules[check->ninference_rules++];
+	rule->src = src;
+	rule->src_len = src_len;
+	rule->dst = dst;
+	rule->dst_len = dst_len;
+	return 0;
+}
+
+
+/* Finds the inference rules, default or not, whose suffixes are known */
+static int
+find_inference_rules(struct makel *ctx, struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct name *name;
+	const char *src, *dst;
+	size_t i, k;
+
+	for (i = 0; i < ELEMSOF(default_inference_rules); i++) {
+		src = default_inference_rules[i][0];
+		dst = default_inference_rules[i][1];
+		if (!is_suffix(graph, check, src, strlen(src)) || (*dst && !is_suffix(graph, check, dst, strlen(dst))))
+			continue;
+		if (add_inference_rule(ctx, check, src, strlen(src), dst, strlen(dst)))
+			return -1;
+	}
+	for (i = 0; i < graph->nodes.count; i++) {
+		if (!(check->kinds[i] & NODE_INFERENCE) || check->first_rule[i] == SIZE_MAX)
+			continue;
+		name = &graph->nodes.names[i];
+		k = get_inference_rule(graph, check, name);
+		if (add_inference_rule(ctx, check, name->str, k, &name->str[k], name->len - k))
+			return -1;
+	}
+	return 0;
+}
+
+
+/* Marks the suffixes, special targets, inference rules and
+ * phony targets, and finds the first rules for each node */
+static int
+classify_nodes(struct makel *ctx, struct graph_check *check)
+{
+	struct graph *graph = &ctx->graph;
+	const struct name *name;
+	const struct rule *rule;
+	size_t i, j, n, node;
+
+	for (i = 0; i < ELEMSOF(default_suffixes); i++)
+		if (add_node(ctx, default_suffixes[i], strlen(default_suffixes[i])) == SIZE_MAX)
+			return -1;
+	n = graph->nodes.count;
+
+	check->kinds = counted_calloc(n, sizeof(*check->kinds));
+	check->first_rule = counted_malloc(n * sizeof(*check->first_rule));
+	check->commands_rule = counted_malloc(n * sizeof(*check->commands_rule));
+	check->first_use = counted_malloc(n * sizeof(*check->first_use));
+	check->edge_start = counted_calloc(n + 1, sizeof(*check->edge_start));
+	if (!check->kinds || !check->first_rule || !check->commands_rule || !check->first_use || !check->edge_start) {
+		if (!ctx->error)
+			ctx->error = errno;
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		check->first_rule[i] = SIZE_MAX;
+		check->commands_rule[i] = SIZE_MAX;
+		check->first_use[i] = SIZE_MAX;
+	}
+	check->default_rule = SIZE_MAX;
+	check->posix_rule = SIZE_MAX;
+	check->wait = find_name(&graph->nodes, ".WAIT", 5);
+
+	for (i = 0; i < ELEMSOF(default_suffixes); i++)
+		check->kinds[find_name(&graph->nodes, default_suffixes[i], strlen(default_suffixes[i]))] |= NODE_SUFFIX;
+	for (i = 0; i < ELEMSOF(special_targets); i++) {
+		node = find_name(&graph->nodes, special_targets[i], strlen(special_targets[i]));
+		if (node != SIZE_MAX)
+			check->kinds[node] |= NODE_SPECIAL;
+	}
+
+	/* Suffixes are only known once every rule has been seen, as
+	 * are inference rules, which are only rules with known suffixes */
+	for (i = 0; i < graph->nrules; i++) {
+		rule = &graph->rules[i];
+		name = &graph->nodes.names[rule->target];
+		if (check->first_rule[rule->target] == SIZE_MAX)
+			check->first_rule[rule->target] = i;
+		if (!(check->kinds[rule->target] & NODE_SPECIAL))
+			continue;
+		if (is_name(name, ".SUFFIXES", 9) && !rule->nprereqs) {
+			for (j = 0; j < n; j++)
+				check->kinds[j] &= (unsigned char)~NODE_SUFFIX;
+		} else if (is_name(name, ".SUFFIXES", 9)) {
+			for (j = 0; j < rule->nprereqs; j++)
+				check->kinds[graph->prereqs[rule->prereqs + j]] |= NODE_SUFFIX;
+		} else if (is_name(name, ".PHONY", 6)) {
+			for (j = 0; j < rule->nprereqs; j++)
+				check->kinds[graph->prereqs[rule->prereqs + j]] |= NODE_PHONY;
+		} else if (is_name(name, ".DEFAULT", 8)) {
+			check->default_rule = i;
+		} else if (is_name(name, ".POSIX", 6) && check->posix_rule == SIZE_MAX) {
+			check->posix_rule = i;
+		}
+	}
+	for (i = 0; i < n; i++)
+		if (!(check->kinds[i] & NODE_SPECIAL) && get_inference_rule(graph, check, &graph->nodes.names[i]))
+			check->kinds[i] |= NODE_INFERENCE;
+	return find_inference_rules(ctx, check);
+}
+
+
+static void
+check_posix_target(struct makel *ctx, const struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct rule *rule;
+
+	if (check->posix_rule == SIZE_MAX)
+		return;
+	rule = &graph->rules[check->posix_rule];
+	if (rule->path != graph->first_path || rule->line != graph->first_line) {
+		/* test cases: posix_target.mk */
+		warnf_unspecified(ctx, WC_POSIX_TARGET, rule->path, rule->line, rule->line,
+		                  ".POSIX is not on the first non-comment line, so "
+		                  "make(1) is not required to conform to POSIX");
+	} else if (rule->nprereqs || (rule->flags & RULE_COMMANDS)) {
+		warnf_unspecified(ctx, WC_POSIX_TARGET, rule->path, rule->line, rule->line,
+		                  ".POSIX has %s, which causes unspecified behaviour",
+		                  rule->nprereqs ? "prerequisites" : "commands");
+	}
+}
+
+
+/* Only one target rule for a target may have commands,
+ * unless the rules are double-colon rules */
+static void
+check_duplicate_commands(struct makel *ctx, struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct rule *rule, *first;
+	const struct name *name;
+	size_t i;
+
+	for (i = 0; i < graph->nrules; i++) {
+		rule = &graph->rules[i];
+		if (!(rule->flags & RULE_COMMANDS) || (check->kinds[rule->target] & (NODE_SPECIAL | NODE_INFERENCE)))
+			continue;
+		if (check->commands_rule[rule->target] == SIZE_MAX) {
+			check->commands_rule[rule->target] = i;
+			continue;
+		}
+		first = &graph->rules[check->commands_rule[rule->target]];
+		if ((first->flags & rule->flags & RULE_DOUBLE_COLON) || (first->path == rule->path && first->line == rule->line))
+			continue;
+		name = &graph->nodes.names[rule->target];
+		/* test cases: duplicate_commands.mk */
+		warnf_unspecified(ctx, WC_DUPLICATE_COMMANDS, rule->path, rule->line, rule->line,
+		                  "%.*s already has commands, from %s:%zu, only one target rule for "
+		                  "a target may have commands", (int)name->len, name->str, first->path, first->line);
+		/* So that the target is not reported again if it is listed again on the line */
+		check->commands_rule[rule->target] = i;
+	}
+}
+
+
+/* Builds the edges from each target to its prerequisites, in the
+ * order of the rules; special targets and inference rules are not
+ * in the graph */
+static int
+build_edges(struct makel *ctx, struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct rule *rule;
+	size_t i, j, n = graph->nodes.count, prereq;
+
+	for (i = 0; i < graph->nrules; i++) {
+		rule = &graph->rules[i];
+		if (!(check->kinds[rule->target] & (NODE_SPECIAL | NODE_INFERENCE)))
+			check->edge_start[rule->target] += rule->nprereqs;
+	}
+	for (i = 1; i <= n; i++)
+		check->edge_start[i] += check->edge_start[i - 1];
+
+	check->edges = counted_malloc((check->edge_start[n] ? check->edge_start[n] : 1) * sizeof(*check->edges));
+	if (!check->edges) {
+		if (!ctx->error)
+			ctx->error = errno;
+		return -1;
+	}
+
+	/* .edge_start[i] is the end of node i's edges, and they are
+	 * filled in backwards, so that it ends up at their start */
+	for (i = graph->nrules; i--;) {
+		rule = &graph->rules[i];
+		if (check->kinds[rule->target] & (NODE_SPECIAL | NODE_INFERENCE))
+			continue;
+		for (j = rule->nprereqs; j--;) {
+			prereq = graph->prereqs[rule->prereqs + j];
+			check->edges[--check->edge_start[rule->target]] = prereq;
+			check->first_use[prereq] = i;
+		}
+	}
+	return 0;
+}
+
+
+static void
+report_cycle(struct makel *ctx, const struct graph_check *check, const size_t *members, size_t n)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct name *name;
+	const struct rule *rule;
+	char *list, *p;
+	size_t i, size = 0, shown = MIN(n, 8), first = SIZE_MAX;
+
+	for (i = 0; i < n; i++)
+		first = MIN(first, check->first_rule[members[i]]);
+	rule = &graph->rules[first];
+
+	for (i = 0; i < shown; i++)
+		size += graph->nodes.names[members[i]].len + 2;
+	list = counted_malloc(size + 3 * sizeof(size_t) + sizeof(", and  more"));
+	if (!list) {
+		if (!ctx->error)
+			ctx->error = errno;
+		return;
+	}
+	p = list;
+	for (i = 0; i < shown; i++) {
+		name = &graph->nodes.names[members[i]];
+		if (i)
+			p = stpcpy(p, ", ");
+		memcpy(p, name->str, name->len);
+		p += name->len;
+	}
+	*p = '\0';
+	if (shown < n)
+		sprintf(p, ", and %zu more", n - shown);
+
+	/* test cases: dependency_cycle.mk */
+	if (n == 1) {
+		warnf_warning(ctx, WC_DEPENDENCY_CYCLE, rule->path, rule->line, rule->line,
+		              "%s depends on itself", list);
+	} else {
+		warnf_warning(ctx, WC_DEPENDENCY_CYCLE, rule->path, rule->line, rule->line,
+		              "dependency cycle between %s", list);
+	}
+	free(list);
+}
+
+
+/* Tarjan's algorithm, with an explicit stack of the nodes being
+ * visited and the next edge to follow from each of them */
+static void
+check_cycles(struct makel *ctx, struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	size_t n = graph->nodes.count, *index, *low, *stack, *visiting, *next_edge;
+	size_t root, v, w, i, nstack = 0, nvisiting = 0, counter = 0, scc;
+	int cycle;
+
+	index = counted_malloc(n * sizeof(*index));
+	low = counted_malloc(n * sizeof(*low));
+	stack = counted_malloc(n * sizeof(*stack));
+	visiting = counted_malloc(n * sizeof(*visiting));
+	next_edge = counted_malloc(n * sizeof(*next_edge));
+	if (!index || !low || !stack || !visiting || !next_edge) {
+		if (!ctx->error)
+			ctx->error = errno;
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		index[i] = SIZE_MAX;
+
+	for (root = 0; root < n; root++) {
+		if (index[root] != SIZE_MAX || check->edge_start[root] == check->edge_start[root + 1])
+			continue;
+		v = root;
+		goto visit;
+
+		while (nvisiting) {
+			v = visiting[nvisiting - 1];
+			if (next_edge[v] < check->edge_start[v + 1]) {
+				w = check->edges[next_edge[v]++];
+				if (w == check->wait) {
+					continue;
+				} else if (index[w] == SIZE_MAX) {
+					v = w;
+					goto visit;
+				} else if (check->kinds[w] & NODE_ON_STACK) {
+					low[v] = MIN(low[v], index[w]);
+				}
+				continue;
+			}
+
+			nvisiting--;
+			if (nvisiting)
+				low[visiting[nvisiting - 1]] = MIN(low[visiting[nvisiting - 1]], low[v]);
+			if (low[v] != index[v])
+				continue;
+
+			/* v is the root of a strongly connected component,
+			 * which is a cycle unless it is a single node that
+			 * does not depend on itself */
+			for (scc = nstack; stack[--scc] != v;);
+			cycle = nstack - scc > 1;
+			for (i = check->edge_start[v]; !cycle && i < check->edge_start[v + 1]; i++)
+				cycle = check->edges[i] == v;
+			for (i = scc; i < nstack; i++)
+				check->kinds[stack[i]] &= (unsigned char)~NODE_ON_STACK;
+			if (cycle)
+				report_cycle(ctx, check, &stack[scc], nstack - scc);
+			nstack = scc;
+			continue;
+
+		visit:
+			index[v] = low[v] = counter++;
+			next_edge[v] = check->edge_start[v];
+			stack[nstack++] = v;
+			check->kinds[v] |= NODE_ON_STACK;
+			visiting[nvisiting++] = v;
+		}
+	}
+
+out:
+	free(index);
+	free(low);
+	free(stack);
+	free(visiting);
+	free(next_edge);
+}
+
+
+/* A prerequisite that make(1) cannot make is an error when make(1) is
+ * run; this cannot be known if a rule is not known, or if there is a
+ * .DEFAULT rule, and the files are looked up relative to the makefile */
+static void
+check_missing_rules(struct makel *ctx, struct graph_check *check)
+{
+	const struct graph *graph = &ctx->graph;
+	const struct name *name;
+	const struct rule *rule;
+	size_t i;
+
+	if (graph->incomplete || ctx->macros.incomplete || check->default_rule != SIZE_MAX)
+		return;
+
+	for (i = 0; i < graph->nodes.count; i++) {
+		if (check->first_use[i] == SIZE_MAX || check->first_rule[i] != SIZE_MAX ||
+		    (check->kinds[i] & (NODE_SPECIAL | NODE_INFERENCE)))
+			continue;
+		name = &graph->nodes.names[i];
+		if (can_make(ctx, check, name))
+			continue;
+		rule = &graph->rules[check->first_use[i]];
+		/* test cases: no_rule.mk */
+		warnf_warning(ctx, WC_NO_RULE, rule->path, rule->line, rule->line,
+		              "%.*s is a prerequisite, but there is no rule to make it, and it does not exist",
+		              (int)name->len, name->str);
+	}
+}
+
+
+/* Called at the end of a run, when every rule in the makefile
+ * and the files it includes is known */
+void
+report_graph_warnings(struct makel *ctx)
+{
+	struct graph_check check;
+	size_t i;
+
+	memset(&check, 0, sizeof(check));
+	if (!classify_nodes(ctx, &check)) {
+		check_posix_target(ctx, &check);
+		check_duplicate_commands(ctx, &check);
+		if (!build_edges(ctx, &check)) {
+			check_cycles(ctx, &check);
+			check_missing_rules(ctx, &check);
+		}
+	}
+	free(check.kinds);
+	free(check.first_rule);
+	free(check.commands_rule);
+	free(check.first_use);
+	free(check.edge_start);
+	free(check.edges);
+	free(check.inference_rules);
+	for (i = 0; i < check.ndirectories; i++)
+		destroy_name_table(&check.directories[i].entries);
+	free(check.directories);
+	destroy_name_table(&check.directory_names);
+}
@@ -0,0 +1,658 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Included files are checked once, with the configuration of the
+ * context that includes them, and their diagnostics are reported
+ * again for every makefile that includes them, for as long as neither
+ * the file nor any file it includes has changed; the cache is shared
+ * by all contexts in the process.
+ *
+ * A context that is checking a top-level makefile can wait for a file
+ * that another thread is checking, but a context that is checking an
+ * included file cannot, as it has files marked as being checked
+ * itself; if it were to wait, two threads could end up waiting for
+ * each other, so instead it checks the file itself, without caching
+ * the result.
+ *
+ * What a file includes depends on the directory include lines are
+ * relative to, and on the files that include it, as a file is not
+ * followed if it includes itself or if it is included through too
+ * many levels; so the directory is a part of the key, a result is
+ * not cached if an include line was not followed for either reason,
+ * and a cached result is not used if it would have been.
+ *
+ * Entries and interned strings are kept between runs, but if there
+ * are too many of them, they are all freed as soon as no run is
+ * active, so that a process that checks makefiles for as long as it
+ * runs does not grow without limit. */
+
+
+/* Files included through more levels than this are not followed */
+#define MAX_INCLUDE_DEPTH 32
+
+/* When there are more cached files or interned strings than these,
+ * they are freed at the end of the next run */
+#define MAX_CACHED_FILES 1024
+#define MAX_INTERNED_STRINGS 4096
+
+struct included_file {
+	struct included_file *next;
+	const char *path; /* Interned */
+	const char *include_dir; /* Interned */
+	struct style style;
+	enum action actions[NUM_WARNING_CLASS];
+	size_t refs; /* Including one for being in the cache */
+	int checking;
+	int error; /* errno value if the file could not be checked */
+	int exit_status;
+	int levels; /* Of include lines followed from the file */
+	int limited; /* Whether an include line was not followed because of where the file was included from */
+	struct diagnostic_list diagnostics;
+	struct include_dep *deps; /* The file itself, and each file it includes */
+	size_t ndeps;
+	struct macro *macros; /* Defined or referenced in the file or any file it includes */
+	size_t nmacros;
+	int macros_incomplete;
+	struct rule_list *rules; /* In the file and any file it includes */
+};
+
+struct interned_string {
+	struct interned_string *next;
+	char str[];
+};
+
+struct prefetch {
+	struct makel ctx;
+	struct include_chain chain;
+	const char **paths;
+	size_t npaths;
+};
+
+/* If both mutexes are locked, cache_mutex is locked first */
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static struct included_file *cache[64];
+static size_t ncached;
+static size_t active_runs; /* Including prefetch threads */
+
+/* Interned strings are only freed when no run is active, so
+ * diagnostics can refer to the path of an included file after
+ * the file has been removed from the cache; there is one for each
+ * path that is included, and for each directory of a makefile */
+static pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct interned_string *interned[64];
+static size_t ninterned;
+
+
+static size_t
+hash_string(const char *s, size_t len)
+{
+	size_t h = 5381;
+	while (len--)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+
+/* Returns NULL on failure */
+static const char *
+intern(const char *s, size_t len)
+{
+	struct interned_string **sp, *new;
+	size_t h = hash_string(s, len) % ELEMSOF(interned);
+
+	pthread_mutex_lock(&intern_mutex);
+	for (sp = &interned[h]; *sp; sp = &(*sp)->next)
+		if (!strncmp((*sp)->str, s, len) && !(*sp)->str[len])
+			goto out;
+	new = counted_malloc(offsetof(struct interned_string, str) + len + 1);
+	if (new) {
+		memcpy(new->str, s, len);
+		new->str[len] = '\0';
+		new->next = NULL;
+		*sp = new;
+		ninterned += 1;
+	}
+out:
+	pthread_mutex_unlock(&intern_mutex);
+	return *sp ? (*sp)->str : NULL;
+}
+
+
+/* Relative paths in include lines are relative to the working
+ * directory of make(1), which we take to be the directory of the
+ * makefile given to it; returns NULL for the working directory */
+const char *
+get_include_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	if (!slash)
+		return NULL;
+	return intern(path, slash == path ? 1 : (size_t)(slash - path));
+}
+
+
+/* Returns NULL on failure */
+static const char *
+resolve_include_path(const char *dir, const char *name, size_t len)
+{
+	const char *ret;
+	char *buf;
+	size_t dirlen;
+
+	if (!dir || name[0] == '/')
+		return intern(name, len);
+	dirlen = strlen(dir);
+	buf = counted_malloc(dirlen + len + 2);
+	if (!buf)
+		return NULL;
+	memcpy(buf, dir, dirlen);
+	buf[dirlen] = '/';
+	memcpy(&buf[dirlen + (dir[dirlen - 1] != '/')], name, len);
+	ret = intern(buf, dirlen + (dir[dirlen - 1] != '/') + len);
+	free(buf);
+	return ret;
+}
+
+
+/* Returns the offset of the first pathname if the line is an include
+ * line, or 0 if it is not, in which case *optionalp is not modified */
+size_t
+parse_include_line(const char *s, size_t len, int *optionalp)
+{
+	size_t i = len && s[0] == '-';
+
+	if (len < i + 8 || memcmp(&s[i], "include", 7) || !isblank(s[i + 7]))
+		return 0;
+	*optionalp = (int)i;
+	return i + 8;
+}
+
+
+/* Finds the next pathname in an include line, pathnames that contain
+ * macro expansions are skipped as we do not expand macros; returns 0
+ * at the end of the line */
+static size_t
+next_include_name(const char *s, size_t len, size_t *offp, size_t *startp)
+{
+	size_t off = *offp, start;
+
+	for (;;) {
+		while (off < len && isblank(s[off]))
+			off++;
+		if (off == len || s[off] == '#')
+			return 0;
+		start = off;
+		while (off < len && !isblank(s[off]) && s[off] != '#')
+			off++;
+		if (!memchr(&s[start], '$', off - start))
+			break;
+	}
+	*offp = off;
+	*startp = start;
+	return off - start;
+}
+
+
+static void
+get_dep(const char *path, const struct stat *st, struct include_dep *dep)
+{
+	dep->path = path;
+	dep->dev = st->st_dev;
+	dep->ino = st->st_ino;
+	dep->size = st->st_size;
+	dep->mtime = st->st_mtim;
+}
+
+
+static int
+is_up_to_date(const struct included_file *f)
+{
+	const struct include_dep *dep;
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < f->ndeps; i++) {
+		dep = &f->deps[i];
+		if (stat(dep->path, &st) || st.st_dev != dep->dev || st.st_ino != dep->ino ||
+		    st.st_size != dep->size || st.st_mtim.tv_sec != dep->mtime.tv_sec ||
+		    st.st_mtim.tv_nsec != dep->mtime.tv_nsec)
+			return 0;
+	}
+	return 1;
+}
+
+
+int
+add_deps(struct makel *ctx, const struct include_dep *deps, size_t n)
+{
+	size_t size;
+	void *new;
+
+	if (n > ctx->deps_size - ctx->ndeps) {
+		size = MAX(ctx->deps_size * 2, ctx->ndeps + n);
+		new = counted_realloc(ctx->deps, size * sizeof(*ctx->deps));
+		if (!new)
+			return -1;
+		ctx->deps = new;
+		ctx->deps_size = size;
+	}
+	memcpy(&ctx->deps[ctx->ndeps], deps, n * sizeof(*deps));
+	ctx->ndeps += n;
+	return 0;
+}
+
+
+/* The file is checked in a context of its own, which captures the
+ * diagnostics, so that they can be reported for each includer */
+static void
+check_included_file(struct included_file *f, int nest_level, const struct include_chain *chain)
+{
+	struct makel ctx;
+	struct file file;
+	struct stat st;
+	int fd;
+
+	init_context(&ctx);
+	ctx.style = f->style;
+	memcpy(ctx.actions, f->actions, sizeof(ctx.actions));
+	ctx.capture = 1;
+	ctx.max_warnings = 0;
+	ctx.include_dir = f->include_dir;
+	ctx.include_chain = chain;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) || load_text_file(&ctx, fd, f->path, nest_level, &file)) {
+		f->error = errno;
+	} else {
+		if (lint_file(&ctx, &file, NULL))
+			f->error = errno;
+		unload_text_file(&file);
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (!f->error) {
+		f->deps = counted_malloc((ctx.ndeps + 1) * sizeof(*f->deps));
+		f->macros = export_macros(&ctx.macros);
+		f->rules = export_rules(&ctx.graph);
+		if (!f->deps || !f->macros || !f->rules) {
+			f->error = errno;
+		} else {
+			/* The file's status from before it was read, so
+			 * that a change while checking it is noticed */
+			get_dep(f->path, &st, &f->deps[0]);
+			if (ctx.ndeps)
+				memcpy(&f->deps[1], ctx.deps, ctx.ndeps * sizeof(*f->deps));
+			f->ndeps = ctx.ndeps + 1;
+			f->nmacros = ctx.macros.count;
+			f->macros_incomplete = ctx.macros.incomplete;
+			f->exit_status = ctx.exit_status;
+			f->levels = ctx.include_levels;
+			f->limited = ctx.include_limited;
+			f->diagnostics = ctx.deferred[0];
+			memset(&ctx.deferred[0], 0, sizeof(ctx.deferred[0]));
+		}
+	}
+	destroy_context(&ctx);
+}
+
+
+static void
+free_included_file(struct included_file *f)
+{
+	free(f->diagnostics.diagnostics);
+	free(f->diagnostics.text);
+	free(f->deps);
+	free(f->macros);
+	free(f->rules);
+	free(f);
+}
+
+
+static void
+release_included_file(struct included_file *f)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (!--f->refs)
+		free_included_file(f);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/* The caller shall lock cache_mutex */
+static void
+remove_from_cache(struct included_file *f)
+{
+	struct included_file **fp;
+
+	for (fp = &cache[hash_string(f->path, strlen(f->path)) % ELEMSOF(cache)]; *fp; fp = &(*fp)->next) {
+		if (*fp == f) {
+			*fp = f->next;
+			ncached -= 1;
+			if (!--f->refs)
+				free_included_file(f);
+			return;
+		}
+	}
+}
+
+
+/* Called when a run of a top-level makefile begins, and when it
+ * ends, after which nothing it has interned may be used */
+void
+begin_include_run(void)
+{
+	pthread_mutex_lock(&cache_mutex);
+	active_runs += 1;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+void
+end_include_run(void)
+{
+	struct interned_string *s;
+	size_t i;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (!--active_runs) {
+		pthread_mutex_lock(&intern_mutex);
+		if (ncached > MAX_CACHED_FILES || ninterned > MAX_INTERNED_STRINGS) {
+			for (i = 0; i < ELEMSOF(cache); i++)
+				while (cache[i])
+					remove_from_cache(cache[i]);
+			for (i = 0; i < ELEMSOF(interned); i++) {
+				while ((s = interned[i])) {
+					interned[i] = s->next;
+					free(s);
+				}
+			}
+			ninterned = 0;
+		}
+		pthread_mutex_unlock(&intern_mutex);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+
+/* Whether the file would have been checked differently if it was
+ * included through `chain` at `nest_level`: the result of a check
+ * that followed every include line is only cached, so that is only
+ * the case if the file now includes itself, or is too deep */
+static int
+depends_on_chain(const struct included_file *f, int nest_level, const struct include_chain *chain)
+{
+	const struct include_chain *c;
+	size_t i;
+
+	if (nest_level + f->levels > MAX_INCLUDE_DEPTH)
+		return 1;
+	for (i = 1; i < f->ndeps; i++)
+		for (c = chain; c; c = c->parent)
+			if (!strcmp(c->path, f->deps[i].path))
+				return 1;
+	return 0;
+}
+
+
+/* Returns the checked file, with a reference that shall be released
+ * with release_included_file(), or NULL on failure */
+static struct included_file *
+get_included_file(struct makel *ctx, const char *path, int nest_level,
+                  const struct include_chain *chain, int may_wait)
+{
+	struct included_file **fp, *f;
+	int cached = 1;
+
+	pthread_mutex_lock(&cache_mutex);
+again:
+	fp = &cache[hash_string(path, strlen(path)) % ELEMSOF(cache)];
+	for (; (f = *fp); fp = &f->next)
+		if (f->path == path && f->include_dir == ctx->include_dir &&
+		    !memcmp(&f->style, &ctx->style, sizeof(f->style)) &&
+		    !memcmp(f->actions, ctx->actions, sizeof(f->actions)))
+			break;
+	if (f && f->checking) {
+		if (may_wait) {
+			pthread_cond_wait(&cache_cond, &cache_mutex);
+			goto again;
+		}
+		cached = 0;
+	} else if (f && !is_up_to_date(f)) {
+		remove_from_cache(f);
+	} else if (f && depends_on_chain(f, nest_level, chain)) {
+		/* Correct for other includers, so it is kept */
+		cached = 0;
+	} else if (f) {
+		f->refs += 1;
+		pthread_mutex_unlock(&cache_mutex);
+		return f;
+	}
+
+	f = counted_calloc(1, sizeof(*f));
+	if (!f) {
+		pthread_mutex_unlock(&cache_mutex);
+		return NULL;
+	}
+	f->path = path;
+	f->include_dir = ctx->include_dir;
+	f->style = ctx->style;
+	memcpy(f->actions, ctx->actions, sizeof(f->actions));
+	f->refs = 1;
+	if (cached) {
+		f->refs += 1;
+		f->checking = 1;
+		f->next = cache[hash_string(path, strlen(path)) % ELEMSOF(cache)];
+		cache[hash_string(path, strlen(path)) % ELEMSOF(cache)] = f;
+		ncached += 1;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+
+	check_included_file(f, nest_level, chain);
+
+	if (cached) {
+		pthread_mutex_lock(&cache_mutex);
+		f->checking = 0;
+		/* The file may be created later, or be included from elsewhere */
+		if (f->error || f->limited)
+			remove_from_cache(f);
+		pthread_cond_broadcast(&cache_cond);
+		pthread_mutex_unlock(&cache_mutex);
+	}
+	return f;
+}
+
+
+static void
+follow_include(struct makel *ctx, struct file *file, size_t i, const char *path, int optional,
+               const struct include_chain *chain)
+{
+	const struct include_chain *c;
+	struct include_chain node;
+	struct included_file *f;
+
+	ctx->followed_includes = 1;
+
+	for (c = chain; c; c = c->parent) {
+		if (!strcmp(c->path, path)) {
+			warnf_warning(ctx, WC_INCLUDE, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			              "%s includes itself, the include line is not followed", path);
+			ctx->include_limited = 1;
+			return;
+		}
+	}
+	if (file->nest_level >= MAX_INCLUDE_DEPTH) {
+		warnf_warning(ctx, WC_INCLUDE, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		              "%s is included through more than %i levels, the include line is not followed",
+		              path, MAX_INCLUDE_DEPTH);
+		ctx->include_limited = 1;
+		ctx->macros.incomplete = 1;
+		return;
+	}
+
+	node.path = path;
+	node.parent = chain;
+	f = get_included_file(ctx, path, file->nest_level + 1, &node, !ctx->include_chain);
+	if (!f) {
+		if (!ctx->error)
+			ctx->error = errno;
+		return;
+	}
+
+	if (f->error) {
+		ctx->macros.incomplete = 1;
+		if (!optional) {
+			warnf_warning(ctx, WC_INCLUDE, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			              "included file %s cannot be checked: %s", path, strerror(f->error));
+		}
+	} else {
+		report_included_diagnostics(ctx, &f->diagnostics);
+		ctx->exit_status = MAX(ctx->exit_status, f->exit_status);
+		merge_macros(ctx, f->macros, f->nmacros);
+		ctx->macros.incomplete |= f->macros_incomplete;
+		merge_rules(ctx, f->rules);
+		ctx->include_levels = MAX(ctx->include_levels, f->levels + 1);
+		ctx->include_limited |= f->limited;
+		if (add_deps(ctx, f->deps, f->ndeps) && !ctx->error)
+			ctx->error = errno;
+	}
+	release_included_file(f);
+}
+
+
+/* Checks each file included by an include line, in place of the
+ * include line, so the diagnostics are reported with those for
+ * the logical line; they are not recorded, instead the line is
+ * followed again when it is replayed, as the included files may
+ * have changed, and their macros and rules are needed anyway */
+void
+follow_include_line(struct makel *ctx, struct file *file, size_t i)
+{
+	struct include_chain top;
+	const struct include_chain *chain = ctx->include_chain;
+	struct record *recording = ctx->recording;
+	const char *data = LINE_DATA(file, i), *path;
+	size_t len = file->lengths[i], off, start;
+	int optional;
+
+	off = parse_include_line(data, len, &optional);
+	if (!off)
+		return;
+	/* An include line continued with a <backslash> has unspecified
+	 * behaviour, so it is not followed; nor are pathnames that use
+	 * macros; either way, not every macro is known */
+	if (!ctx->follow_includes || (file->flags[i] & LINE_CONTINUED) || memchr(&data[off], '$', len - off)) {
+		ctx->macros.incomplete = 1;
+		if (!ctx->follow_includes || (file->flags[i] & LINE_CONTINUED))
+			return;
+	}
+
+	if (!chain) {
+		top.path = file->path;
+		top.parent = NULL;
+		chain = &top;
+	}
+
+	ctx->recording = NULL;
+	while (next_include_name(data, len, &off, &start)) {
+		path = resolve_include_path(ctx->include_dir, &data[start], off - start);
+		if (!path) {
+			if (!ctx->error)
+				ctx->error = errno;
+			break;
+		}
+		follow_include(ctx, file, i, path, optional, chain);
+	}
+	ctx->recording = recording;
+}
+
+
+static void *
+prefetch_thread(void *arg)
+{
+	struct prefetch *prefetch = arg;
+	struct included_file *f;
+	struct include_chain node;
+	size_t i;
+
+	node.parent = &prefetch->chain;
+	for (i = 0; i < prefetch->npaths; i++) {
+		node.path = prefetch->paths[i];
+		f = get_included_file(&prefetch->ctx, prefetch->paths[i], 1, &node, 0);
+		if (f)
+			release_included_file(f);
+	}
+
+	destroy_context(&prefetch->ctx);
+	free(prefetch->paths);
+	free(prefetch);
+	end_include_run();
+	return NULL;
+}
+
+
+/* Starts checking the files included by a makefile on another thread,
+ * before the makefile's include lines are reached; this is only a
+ * head start, so failures are ignored, and a file is not skipped if
+ * it is not a simple include line or not followed for other reasons */
+void
+prefetch_includes(struct makel *ctx, struct file *file)
+{
+	struct prefetch *prefetch;
+	pthread_attr_t attr;
+	pthread_t thread;
+	const char *data, *path;
+	size_t i, len, off, start;
+	int optional, started = 0;
+	void *new;
+
+	if (!ctx->follow_includes || ctx->include_chain)
+		return;
+
+	prefetch = counted_calloc(1, sizeof(*prefetch));
+	if (!prefetch)
+		return;
+	init_context(&prefetch->ctx);
+	prefetch->ctx.style = ctx->style;
+	memcpy(prefetch->ctx.actions, ctx->actions, sizeof(ctx->actions));
+	prefetch->ctx.include_dir = ctx->include_dir;
+	prefetch->chain.path = file->path;
+	prefetch->chain.parent = NULL;
+
+	for (i = 0; i < file->nlines; i++) {
+		data = LINE_DATA(file, i);
+		len = file->lengths[i];
+		if (!len || (data[0] != 'i' && data[0] != '-') || data[len - 1] == '\\')
+			continue;
+		off = parse_include_line(data, len, &optional);
+		while (off && next_include_name(data, len, &off, &start)) {
+			path = resolve_include_path(ctx->include_dir, &data[start], off - start);
+			if (!path || !strcmp(path, file->path))
+				continue;
+			new = counted_realloc(prefetch->paths, (prefetch->npaths + 1) * sizeof(*prefetch->paths));
+			if (!new)
+				goto out;
+			prefetch->paths = new;
+			prefetch->paths[prefetch->npaths++] = path;
+		}
+	}
+
+	if (prefetch->npaths && !pthread_attr_init(&attr)) {
+		/* The thread may outlive the run, it has interned paths */
+		begin_include_run();
+		if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED))
+			started = !pthread_create(&thread, &attr, prefetch_thread, prefetch);
+		if (!started)
+			end_include_run();
+		pthread_attr_destroy(&attr);
+	}
+
+out:
+	if (!started) {
+		destroy_context(&prefetch->ctx);
+		free(prefetch->paths);
+		free(prefetch);
+	}
+}
@@ -0,0 +1,380 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+struct makel *
+makel_create(void)
+{
+	struct makel *ctx = counted_malloc(sizeof(*ctx));
+	if (ctx)
+		init_context(ctx);
+	return ctx;
+}
+
+
+void
+makel_destroy(struct makel *ctx)
+{
+	if (ctx) {
+		destroy_context(ctx);
+		free(ctx);
+	}
+}
+
+
+void
+makel_set_diagnostic_callback(struct makel *ctx, makel_diagnostic_callback_t *callback, void *user)
+{
+	ctx->callback = callback;
+	ctx->user = user;
+}
+
+
+int
+makel_set_warning_action(struct makel *ctx, const char *class, enum makel_action action)
+{
+	size_t i;
+
+	if (action < MAKEL_IGNORE || action > MAKEL_WARN)
+		goto einval;
+
+	for (i = 0; i < NUM_WARNING_CLASS; i++) {
+		if (!strcmp(warning_classes[i].name, class)) {
+			ctx->actions[i] = (enum action)action;
+			return 0;
+		}
+	}
+
+einval:
+	errno = EINVAL;
+	return -1;
+}
+
+
+void
+makel_set_max_line_length(struct makel *ctx, size_t max)
+{
+	ctx->style.max_line_length = max;
+}
+
+
+void
+makel_set_jobs(struct makel *ctx, size_t jobs)
+{
+	ctx->jobs = jobs;
+}
+
+
+void
+makel_set_max_warnings(struct makel *ctx, size_t max)
+{
+	ctx->max_warnings = max;
+}
+
+
+size_t
+makel_get_warning_count(const struct makel *ctx, const char *class)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_WARNING_CLASS; i++)
+		if (!strcmp(warning_classes[i].name, class))
+			return ctx->counts[i];
+	return 0;
+}
+
+
+void
+makel_set_follow_includes(struct makel *ctx, int follow)
+{
+	ctx->follow_includes = follow;
+}
+
+
+static void
+begin_run(struct makel *ctx)
+{
+	size_t i;
+
+	/* Nothing is left over from an earlier run, even if it failed */
+	ctx->exit_status = 0;
+	ctx->error = 0;
+	ctx->queue = 0;
+	memset(ctx->counts, 0, sizeof(ctx->counts));
+	ctx->followed_includes = 0;
+	ctx->include_levels = 0;
+	ctx->include_limited = 0;
+	ctx->ndeps = 0;
+	clear_macro_table(&ctx->macros);
+	clear_graph(&ctx->graph);
+	memset(ctx->passed, 0, sizeof(ctx->passed));
+	for (i = 0; i < ELEMSOF(ctx->deferred); i++) {
+		ctx->deferred[i].count = 0;
+		ctx->deferred[i].text_len = 0;
+	}
+	begin_include_run();
+}
+
+
+/* Returns `r`, every run shall end here */
+static int
+end_run(int r)
+{
+	int saved_errno = errno;
+	end_include_run();
+	errno = saved_errno;
+	return r;
+}
+
+
+static int
+lint_loaded_file(struct makel *ctx, struct file *file)
+{
+	int r, saved_errno;
+
+	r = lint_file(ctx, file, NULL);
+	if (!r)
+		report_warning_counts(ctx);
+	saved_errno = errno;
+	unload_text_file(file);
+	errno = saved_errno;
+	return end_run(r ? -1 : ctx->exit_status);
+}
+
+
+int
+makel_lint_fd(struct makel *ctx, int fd, const char *path)
+{
+	struct file file;
+	struct timespec timer;
+
+	begin_run(ctx);
+	BEGIN_PHASE(ctx, &timer);
+	if (load_text_file(ctx, fd, path, 0, &file))
+		return end_run(-1);
+	END_PHASE(ctx, &timer, PHASE_LOAD, file.nlines, file.size);
+	return lint_loaded_file(ctx, &file);
+}
+
+
+int
+makel_lint_stream(struct makel *ctx, int fd, const char *path)
+{
+	struct text_stream stream;
+	int r, saved_errno;
+
+	begin_run(ctx);
+	open_text_stream(fd, path, 0, &stream);
+	r = lint_stream(ctx, &stream);
+	if (!r)
+		report_warning_counts(ctx);
+	saved_errno = errno;
+	unload_text_file(&stream.file);
+	errno = saved_errno;
+	return end_run(r ? -1 : ctx->exit_status);
+}
+
+
+int
+makel_lint_buffer(struct makel *ctx, const void *data, size_t len, const char *path)
+{
+	struct file file;
+	struct timespec timer;
+
+	begin_run(ctx);
+	BEGIN_PHASE(ctx, &timer);
+	if (load_text_buffer(ctx, data, len, path, 0, &file))
+		return end_run(-1);
+	END_PHASE(ctx, &timer, PHASE_LOAD, file.nlines, file.size);
+	return lint_loaded_file(ctx, &file);
+}
+
+
+struct makel_snapshot *
+makel_snapshot_create(void)
+{
+	return counted_calloc(1, sizeof(struct makel_snapshot));
+}
+
+
+static void
+clear_snapshot(struct makel_snapshot *snapshot)
+{
+	free(snapshot->path);
+	free(snapshot->continued);
+	destroy_record(&snapshot->record);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+
+
+void
+makel_snapshot_destroy(struct makel_snapshot *snapshot)
+{
+	if (snapshot) {
+		clear_snapshot(snapshot);
+		free(snapshot);
+	}
+}
+
+
+/* Maps each line to the line in the previous version it is
+ * a copy of, or to SIZE_MAX if it was added by an edit */
+static int
+map_lines(const struct makel_edit *edits, size_t nedits, size_t old_nlines, size_t nlines, size_t *old_line)
+{
+	size_t i = 0, j = 0, k, n, start;
+
+	for (k = 0; k < nedits; k++) {
+		start = edits[k].first_line - 1;
+		if (!edits[k].first_line || start < j || start > old_nlines ||
+		    edits[k].old_count > old_nlines - start || start - j > nlines - i)
+			return -1;
+		while (j < start)
+			old_line[i++] = j++;
+		if (edits[k].new_count > nlines - i)
+			return -1;
+		for (n = 0; n < edits[k].new_count; n++)
+			old_line[i++] = SIZE_MAX;
+		j += edits[k].old_count;
+	}
+	if (old_nlines - j != nlines - i)
+		return -1;
+	while (j < old_nlines)
+		old_line[i++] = j++;
+	return 0;
+}
+
+
+/* Decides which lines must be checked again: lines that were
+ * edited or moved next to an edit, and any line that is in the
+ * same logical line as such a line, in this or the previous
+ * version, as the checks look at entire logical lines */
+static int
+find_dirty_lines(const struct makel_snapshot *snapshot, const unsigned char *continued,
+                 size_t nlines, size_t *old_line)
+{
+	unsigned char *dirty;
+	size_t i, j;
+
+	dirty = counted_malloc(nlines ? nlines : 1);
+	if (!dirty)
+		return -1;
+
+	/* Edits at the very beginning or end, and deleted lines,
+	 * are detected by the line's neighbours having moved */
+	for (i = 0; i < nlines; i++) {
+		j = old_line[i];
+		dirty[i] = j == SIZE_MAX ||
+		           (i ? !j || old_line[i - 1] != j - 1 : j != 0) ||
+		           (i + 1 < nlines ? old_line[i + 1] != j + 1 : j + 1 != snapshot->record.nlines);
+	}
+
+	/* Two clean lines that are next to each other were also
+	 * next to each other in the previous version; if they are
+	 * in the same logical line in either version, one of them
+	 * can only be clean if the other one is, and since logical
+	 * lines are contiguous, one pass in each direction is enough */
+#define LINKED(I) (continued[I] || snapshot->continued[old_line[I]])
+	for (i = 1; i < nlines; i++)
+		if (dirty[i - 1] && !dirty[i] && LINKED(i - 1))
+			dirty[i] = 1;
+	for (i = nlines; i-- > 1;)
+		if (dirty[i] && !dirty[i - 1] && LINKED(i - 1))
+			dirty[i - 1] = 1;
+#undef LINKED
+
+	for (i = 0; i < nlines; i++)
+		if (dirty[i])
+			old_line[i] = SIZE_MAX;
+	free(dirty);
+	return 0;
+}
+
+
+int
+makel_relint_buffer(struct makel *ctx, struct makel_snapshot *snapshot, const void *data, size_t len,
+                    const char *path, const struct makel_edit *edits, size_t nedits)
+{
+	struct file file;
+	struct relint relint;
+	struct record record;
+	unsigned char *continued = NULL;
+	char *path_copy = NULL;
+	size_t i, nlines;
+	int r, saved_errno, reuse;
+
+	begin_run(ctx);
+	if (load_text_buffer(ctx, data, len, path, 0, &file))
+		return end_run(-1);
+	nlines = file.nlines;
+
+	memset(&record, 0, sizeof(record));
+	relint.record = &record;
+	relint.previous = &snapshot->record;
+	relint.old_line = counted_malloc((nlines ? nlines : 1) * sizeof(*relint.old_line));
+	continued = counted_malloc(nlines ? nlines : 1);
+	path_copy = counted_malloc(strlen(path) + 1);
+	if (!relint.old_line || !continued || !path_copy)
+		goto fail;
+	strcpy(path_copy, path);
+
+	/* Recorded before the line continuations are removed */
+	for (i = 0; i < nlines; i++)
+		continued[i] = file.lengths[i] && LINE_DATA(&file, i)[file.lengths[i] - 1] == '\\';
+
+	reuse = snapshot->valid && !strcmp(snapshot->path, path) &&
+	        !memcmp(&snapshot->style, &ctx->style, sizeof(ctx->style)) &&
+	        !memcmp(snapshot->actions, ctx->actions, sizeof(ctx->actions)) &&
+	        !map_lines(edits, nedits, snapshot->record.nlines, nlines, relint.old_line);
+	if (!reuse) {
+		for (i = 0; i < nlines; i++)
+			relint.old_line[i] = SIZE_MAX;
+	} else if (find_dirty_lines(snapshot, continued, nlines, relint.old_line)) {
+		goto fail;
+	}
+
+	r = lint_file(ctx, &file, &relint);
+	if (r || finish_record(&record, nlines))
+		goto fail;
+	report_warning_counts(ctx);
+
+	clear_snapshot(snapshot);
+	snapshot->valid = 1;
+	snapshot->path = path_copy;
+	snapshot->style = ctx->style;
+	memcpy(snapshot->actions, ctx->actions, sizeof(ctx->actions));
+	snapshot->continued = continued;
+	snapshot->record = record;
+	free(relint.old_line);
+	unload_text_file(&file);
+	return end_run(ctx->exit_status);
+
+fail:
+	/* The snapshot is no longer usable, as we may have
+	 * reported diagnostics that it does not include */
+	saved_errno = errno;
+	clear_snapshot(snapshot);
+	destroy_record(&record);
+	free(relint.old_line);
+	free(continued);
+	free(path_copy);
+	unload_text_file(&file);
+	errno = saved_errno;
+	return end_run(-1);
+}
+
+
+int
+makel_lint_path(struct makel *ctx, const char *path)
+{
+	int fd, r, saved_errno;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	r = makel_lint_fd(ctx, fd, path);
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return r;
+}
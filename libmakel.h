@@ -0,0 +1,210 @@
+/* See LICENSE file for copyright and license details. */
+#ifndef LIBMAKEL_H
+#define LIBMAKEL_H
+
+#include <stddef.h>
+
+
+/**
+ * What to do with diagnostics in a warning class
+ */
+enum makel_action {
+	MAKEL_IGNORE,     /* Do not report */
+	MAKEL_INFORM,     /* Report, but do not affect the status */
+	MAKEL_WARN_STYLE, /* Report as a style issue */
+	MAKEL_WARN        /* Report as a warning */
+};
+
+enum makel_diagnostic_kind {
+	MAKEL_WARNING,
+	MAKEL_INFO, /* Additional information about the last warning */
+	MAKEL_TIP,  /* Suggestion about the last warning */
+	MAKEL_COUNT /* Number of warnings in a class, reported at the end of a run */
+};
+
+struct makel_diagnostic {
+	enum makel_diagnostic_kind kind;
+	const char *class_name;   /* For example "long-line" */
+	enum makel_action action; /* How the class is configured */
+	int severity;             /* The exit status makel(1) would use, 0 unless .kind is MAKEL_WARNING */
+	const char *path;         /* NULL if not about a file */
+	size_t first_line;        /* 0 if not about a specific line */
+	size_t last_line;         /* Same as .first_line unless about multiple lines */
+	const char *text;
+};
+
+typedef void makel_diagnostic_callback_t(void *user, const struct makel_diagnostic *diagnostic);
+
+/**
+ * Per-run context; a context may only be used by one thread at
+ * a time, but any number of contexts can be used concurrently
+ */
+struct makel;
+
+
+/**
+ * Create a context with the default configuration
+ *
+ * @return  The context, or NULL on failure
+ */
+struct makel *makel_create(void);
+
+void makel_destroy(struct makel *ctx);
+
+/**
+ * Set the function that receives diagnostics; diagnostics
+ * are discarded until a callback has been set
+ *
+ * The diagnostic and its strings are only valid during the call
+ */
+void makel_set_diagnostic_callback(struct makel *ctx, makel_diagnostic_callback_t *callback, void *user);
+
+/**
+ * Configure a warning class
+ *
+ * @param   class  The name of the class, for example "long-line"
+ * @return         0 on success, -1 on failure (EINVAL if the class does not exist)
+ */
+int makel_set_warning_action(struct makel *ctx, const char *class, enum makel_action action);
+
+void makel_set_max_line_length(struct makel *ctx, size_t max);
+
+/**
+ * Allow a large makefile to be split into parts that are checked
+ * on separate threads; the diagnostics are reported on the calling
+ * thread, after all parts have been checked, in the same order as
+ * if the makefile was checked on one thread
+ *
+ * Only makel_lint_fd(), makel_lint_buffer() and makel_lint_path()
+ * split makefiles, and not makefiles smaller than 2 MiB
+ *
+ * @param  jobs  The maximum number of threads, 0 and 1 (the default)
+ *               mean that only the calling thread is used
+ */
+void makel_set_jobs(struct makel *ctx, size_t jobs);
+
+/**
+ * Choose whether files included by include lines are checked,
+ * as part of the makefile, which is the default
+ *
+ * Relative paths are resolved from the directory of the makefile,
+ * which is assumed to be where make(1) is run; an included file
+ * is only checked once for as long as it does not change, even
+ * if it is included by many makefiles in the same directory, or
+ * in different contexts
+ *
+ * @param  follow  Non-zero to follow include lines, 0 to ignore them
+ */
+void makel_set_follow_includes(struct makel *ctx, int follow);
+
+/**
+ * Limit the number of warnings reported per class and run; the
+ * remaining warnings, and their notes, are neither formatted nor
+ * reported, but they still affect the exit status, and they are
+ * included in the MAKEL_COUNT diagnostic that is reported for each
+ * class that had any warnings at the end of the run
+ *
+ * @param  max  The number of warnings reported per class,
+ *              0 for no limit; the default is 100
+ */
+void makel_set_max_warnings(struct makel *ctx, size_t max);
+
+/**
+ * Get the number of warnings in a class in the last run,
+ * including suppressed warnings but not ignored warnings
+ *
+ * @param   class  The name of the class, for example "long-line"
+ * @return         The number of warnings, 0 if the class does not exist
+ */
+size_t makel_get_warning_count(const struct makel *ctx, const char *class);
+
+/**
+ * Check a makefile
+ *
+ * wcwidth(3) is used to count columns, so LC_CTYPE should be
+ * set, with setlocale(3), before any makefile is checked
+ *
+ * @param   fd    File descriptor to read the makefile from, it is not closed
+ * @param   path  The name of the file, as used in diagnostics
+ * @return        The exit status makel(1) would use, or -1 on failure
+ */
+int makel_lint_fd(struct makel *ctx, int fd, const char *path);
+
+/**
+ * Like makel_lint_fd(), but the makefile is checked as it is read,
+ * so diagnostics are reported before the end of the file is reached,
+ * and only the logical line being checked is kept in memory
+ *
+ * The diagnostics are the same, but each check is completed on a
+ * logical line before the next is made, instead of on the whole
+ * makefile, so they are reported in a different order
+ *
+ * @param   fd    File descriptor to read the makefile from, it is not closed
+ * @param   path  The name of the file, as used in diagnostics
+ * @return        The exit status makel(1) would use, or -1 on failure
+ */
+int makel_lint_stream(struct makel *ctx, int fd, const char *path);
+
+/**
+ * Check a makefile that is already in memory
+ *
+ * @param   data  The content of the makefile, it is not modified
+ * @param   len   The number of bytes in `data`
+ * @param   path  The name of the file, as used in diagnostics
+ * @return        The exit status makel(1) would use, or -1 on failure
+ */
+int makel_lint_buffer(struct makel *ctx, const void *data, size_t len, const char *path);
+
+/**
+ * How a makefile has changed since it was last checked,
+ * in the same way as a hunk in a unified diff
+ */
+struct makel_edit {
+	size_t first_line; /* The first replaced line in the earlier version, counting from 1 */
+	size_t old_count;  /* The number of lines in the earlier version that were replaced */
+	size_t new_count;  /* The number of lines that replaced them */
+};
+
+/**
+ * The result of the last check of a makefile, used to
+ * check the makefile again after it has been edited
+ */
+struct makel_snapshot;
+
+/**
+ * Create an empty snapshot
+ *
+ * @return  The snapshot, or NULL on failure
+ */
+struct makel_snapshot *makel_snapshot_create(void);
+
+void makel_snapshot_destroy(struct makel_snapshot *snapshot);
+
+/**
+ * Like makel_lint_buffer(), but only lines affected by `edits` are
+ * checked again, the diagnostics for other lines are taken from
+ * `snapshot`, which is then updated to describe this check
+ *
+ * The whole makefile is checked if the snapshot is empty or was
+ * made with another path or configuration, or if the edits do not
+ * match the number of lines in the makefile; the NUL byte, missing
+ * <newline> and line length checks are always made on the whole
+ * makefile as it is split into lines
+ *
+ * @param   edits   The changes since the snapshot was made, in order and not overlapping
+ * @param   nedits  The number of elements in `edits`
+ * @return          The exit status makel(1) would use, or -1 on failure,
+ *                  in which case the snapshot is emptied
+ */
+int makel_relint_buffer(struct makel *ctx, struct makel_snapshot *snapshot, const void *data, size_t len,
+                        const char *path, const struct makel_edit *edits, size_t nedits);
+
+/**
+ * Check a makefile
+ *
+ * @param   path  The file to check
+ * @return        The exit status makel(1) would use, or -1 on failure
+ */
+int makel_lint_path(struct makel *ctx, const char *path);
+
+#endif
@@ -0,0 +1,563 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+static void
+set_line_continuation_joiner(struct file *file, size_t i)
+{
+	const char *data = LINE_DATA(file, i);
+
+	file->flags[i] &= (unsigned char)~(LINE_CONTINUED | LINE_CMD_JOINER);
+	if (file->lengths[i] && data[file->lengths[i] - 1] == '\\') {
+		file->lengths[i] -= 1;
+		file->flags[i] |= LINE_CONTINUED;
+		/* Doesn't matter here if the first non-white space is #;
+		 * a continuation of a command line need not begin with a
+		 * <tab>, but is still a part of the command line */
+		if (i && (file->flags[i - 1] & LINE_CONTINUED) ? (file->flags[i - 1] & LINE_CMD_JOINER) : data[0] == '\t')
+			file->flags[i] |= LINE_CMD_JOINER;
+	}
+}
+
+
+static void
+check_line_continuation(struct makel *ctx, struct file *file, size_t i, size_t *cont_fromp)
+{
+	size_t cont_from = *cont_fromp;
+	int prev_continued = i && (file->flags[i - 1] & LINE_CONTINUED);
+	const char *data, *cont_from_data;
+
+	set_line_continuation_joiner(file, i);
+
+	if ((file->flags[i] & LINE_CONTINUED) && !prev_continued && is_line_blank(file, i)) {
+		/* test cases: cont_of_blank.mk */
+		warnf_confusing(ctx, WC_CONTINUATION_OF_BLANK, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		                "initial line continuation on otherwise blank line, can cause confusion");
+	}
+
+	if (!(file->flags[i] & LINE_CONTINUED) && prev_continued && is_line_blank(file, i)) {
+		/* test cases: cont_to_blank.mk */
+		warnf_confusing(ctx, WC_CONTINUATION_TO_BLANK, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		                "terminal line continuation to blank line, can cause confusion");
+	}
+
+	if ((file->flags[i] & LINE_CONTINUED) && (file->flags[i] & LINE_EOF)) {
+		/* test cases: eof_cont.mk (TODO with file->nest_level) */
+		warnf_unspecified(ctx, WC_EOF_LINE_CONTINUATION, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		                  "line continuation at end of file, causes unspecified behaviour%s",
+		                  !file->nest_level ? "" :
+		                  ", it is especially problematic in an included line");
+		printinfof(ctx, WC_EOF_LINE_CONTINUATION, "this implementation will remove the line continuation");
+		file->flags[i] &= (unsigned char)~(LINE_CONTINUED | LINE_CMD_JOINER);
+	}
+
+	if (prev_continued && file->lengths[i]) {
+		data = LINE_DATA(file, i);
+		cont_from_data = LINE_DATA(file, cont_from);
+		if (!isspace(data[0])) {
+			if (file->lengths[cont_from] && !isspace(cont_from_data[file->lengths[cont_from] - 1])) {
+				/* test cases: cont_without_ws.mk (TODO with i != cont_from + 1) */
+				warnf_confusing(ctx, WC_SPACELESS_CONTINUATION, file->path,
+				                LINE_NUMBER(file, cont_from), LINE_NUMBER(file, i),
+				                "<backslash> is proceeded by a non-white space "
+				                "character at the same time as the next line%s begins with "
+				                "a non-white space character, this can cause confusion as "
+				                "the make utility will add a whitespace",
+				                i == cont_from + 1 ? "" :
+				                ", that consist of not only a <backslash>,");
+			}
+			/* test cases: unindented_cont.mk, cont_without_ws.mk */
+			warnf_confusing(ctx, WC_UNINDENTED_CONTINUATION, file->path,
+			                LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			                "continuation of line is not indented, can cause confusion");
+		}
+		*cont_fromp = i;
+	} else if (file->flags[i] & LINE_CONTINUED) {
+		*cont_fromp = i;
+	}
+}
+
+
+static enum line_class
+classify_line(struct makel *ctx, struct file *file, size_t i)
+{
+	int warned_bad_space = 0;
+	const char *data, *s, *end;
+
+	if (!file->lengths[i])
+		return EMPTY;
+
+start_over:
+	s = data = LINE_DATA(file, i);
+	end = &s[file->lengths[i]];
+
+	while (s != end && isspace(*s)) {
+		if (!warned_bad_space && !isblank(*s)) {
+			warned_bad_space = 1;
+			/* test cases: bad_ws.mk, noninitial_bad_ws.mk */
+			warnf_undefined(ctx, WC_LEADING_BAD_SPACE, file->path,
+			                LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			                "line contains leading white space other than "
+		        	        "<space> and <tab>, which causes undefined behaviour");
+			/* TODO what do we do here? */
+		}
+		s++;
+	}
+
+	if (s == end) {
+		if (file->flags[i] & LINE_CONTINUED) {
+			i++;
+			goto start_over;
+		}
+		return BLANK;
+
+	} else if (*s == '#') {
+		if (data[0] != '#') {
+			/* TODO should not apply if command line */
+			/* test cases: ws_before_comment.mk */
+			warnf_undefined(ctx, WC_ILLEGAL_INDENT, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			                "comment has leading white space, which is not legal");
+			printinfof(ctx, WC_ILLEGAL_INDENT, "this implementation will recognise it as a comment line");
+		}
+		return COMMENT;
+
+	} else if (data[0] == '\t') {
+		return COMMAND_LINE;
+
+	} else {
+		if (*s == '-') { /* We will warn about this later */
+			s++;
+			while (s != end && isspace(*s))
+				s++;
+		}
+
+		/* TODO unspecified behaviour if include line with <backslash> */
+		/* TODO unspecified behaviour if continuation that looks like an include line */
+		return OTHER;
+	}
+}
+
+
+/* Only used for statistics */
+static size_t
+logical_line_size(struct file *file, size_t i)
+{
+	size_t size = file->lengths[i];
+	while (file->flags[i] & LINE_CONTINUED)
+		size += file->lengths[++i];
+	return size;
+}
+
+
+/* In make(1) a comment can have a line continuation, but in sh(1)
+ * comments cannot have line continuation, and any <number-sign>
+ * outside a command line begins a comment, even if it is quoted
+ * or after a <backslash>; some implementations of make do not
+ * recognise comments in command lines and instead rely on sh(1)
+ * ignoring comments, so in command lines, only what sh(1) would
+ * see as a comment is checked, and make(1)'s macro expansions
+ * are not comments */
+static void
+check_command_comments(struct makel *ctx, struct file *file, size_t i)
+{
+	struct command_scanner scanner;
+	struct logical_line line;
+	struct span span;
+
+	init_command_scanner(&scanner);
+	open_logical_line(&line, file, i);
+	while (next_span(&line, &span)) {
+		scan_command(&scanner, span.s, span.len);
+		/* The joiner ends a comment, so this is only after the line's text */
+		if (scanner.state == CMD_COMMENT && (file->flags[span.line] & LINE_CONTINUED)) {
+			/* test cases: command_comment_cont.mk, command_quoted_hash.mk */
+			warnf_confusing(ctx, WC_COMMENT_CONTINUATION, file->path,
+			                LINE_NUMBER(file, span.line), LINE_NUMBER(file, span.line),
+			                "line continuation at the end of a comment in a command line, "
+			                "sh(1) will run the next line rather than treat it as a part "
+			                "of the comment, and this can cause confusion");
+		}
+	}
+}
+
+
+static void
+check_logical_line(struct makel *ctx, struct file *file, size_t i)
+{
+	struct timespec timer;
+	enum line_class class;
+
+	BEGIN_PHASE(ctx, &timer);
+	class = classify_line(ctx, file, i);
+	END_PHASE(ctx, &timer, PHASE_CLASSIFY, 1, logical_line_size(file, i));
+
+	switch (class) {
+	case EMPTY:
+		break;
+
+	case BLANK:
+		if (ctx->style.only_empty_blank_lines) {
+			/* TODO test cases */
+			warnf_style(ctx, WC_NONEMPTY_BLANK, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			            "line is blank but not empty");
+		}
+		break;
+
+	case COMMENT:
+		break;
+
+	case COMMAND_LINE:
+		/* TODO list may, for historical reasons, end at a comment line;
+		 *      note, the specifications specify “comment line” which is
+		 *      define to include empty and blank lines; note however
+		 *      that a line that begins with a <hash> that is prefixed
+		 *      by whitespace is not a comment line, so, if it begins
+		 *      with <tab> followed by zero or more whitespace, and then
+		 *      a <hash>, it a command line, not a comment line. */
+	case OTHER:
+		/* Logical lines are read with next_span(), which joins continued lines */
+		BEGIN_PHASE(ctx, &timer);
+		scan_macros(ctx, file, i, 1);
+		END_PHASE(ctx, &timer, PHASE_MACROS, 1, logical_line_size(file, i));
+		BEGIN_PHASE(ctx, &timer);
+		scan_rules(ctx, file, i);
+		END_PHASE(ctx, &timer, PHASE_RULES, 1, logical_line_size(file, i));
+		follow_include_line(ctx, file, i);
+		break;
+
+	default:
+		abort();
+	}
+
+	if (class == COMMAND_LINE) {
+		check_command_comments(ctx, file, i);
+		return;
+	}
+	while (file->flags[i] & LINE_CONTINUED) {
+		if (memchr(LINE_DATA(file, i), '#', file->lengths[i])) { /* TODO could also be a non-standard internal macro */
+			/* test cases: comment_cont.mk */
+			warnf_confusing(ctx, WC_COMMENT_CONTINUATION, file->path,
+			                LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			                "using continuation of line to continue "
+			                "a comment on the next line can cause confusion");
+		}
+		i += 1;
+	}
+}
+
+
+/* Checks a line, and if it is the last line in a logical line, the logical
+ * line, which begins at *firstp; the diagnostics are deferred so that they
+ * are in the same order as if each check was done over all lines before
+ * the next check, until flush_deferred_diagnostics() is called */
+static int
+lint_line(struct makel *ctx, struct file *file, size_t i, size_t *firstp, size_t *cont_fromp)
+{
+	struct timespec timer;
+
+	BEGIN_PHASE(ctx, &timer);
+	if (check_utf8_encoding(ctx, file, i))
+		return -1;
+	END_PHASE(ctx, &timer, PHASE_ENCODING, 1, file->lengths[i]);
+
+	BEGIN_PHASE(ctx, &timer);
+	check_column_count(ctx, file, i);
+	END_PHASE(ctx, &timer, PHASE_COLUMNS, 1, file->lengths[i]);
+
+	defer_diagnostics(ctx, 1);
+	BEGIN_PHASE(ctx, &timer);
+	check_line_continuation(ctx, file, i, cont_fromp);
+	END_PHASE(ctx, &timer, PHASE_CONTINUATIONS, 1, file->lengths[i]);
+
+	/* A logical line can be checked once its last physical line
+	 * is known, which requires that continuation of the line has
+	 * been checked on each of them */
+	if (!(file->flags[i] & LINE_CONTINUED)) {
+		defer_diagnostics(ctx, 2);
+		check_logical_line(ctx, file, *firstp);
+		*firstp = i + 1;
+	}
+	defer_diagnostics(ctx, 0);
+	return 0;
+}
+
+
+/* Files smaller than this are not split, and
+ * no part of a split file is smaller than this */
+#define MIN_CHUNK_SIZE (1 << 20)
+
+struct chunk {
+	struct makel ctx;
+	struct stats stats;
+	struct file file;
+	pthread_t thread;
+	int started;
+	int failed;
+	int saved_errno;
+};
+
+
+static void *
+lint_chunk(void *arg)
+{
+	struct chunk *chunk = arg;
+	size_t i, first = 0, cont_from = 0;
+
+	for (i = 0; i < chunk->file.nlines; i++) {
+		if (lint_line(&chunk->ctx, &chunk->file, i, &first, &cont_from)) {
+			chunk->failed = 1;
+			chunk->saved_errno = errno;
+			break;
+		}
+	}
+	return NULL;
+}
+
+
+/* Returns the first line that begins at or after a byte offset,
+ * lines are in order as no line has been rewritten yet */
+static size_t
+find_line_at(struct file *file, size_t offset)
+{
+	size_t lo = 0, hi = file->nlines, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (file->offsets[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+/* Returns the first line at or after line i that begins a logical line */
+static size_t
+find_logical_line(struct file *file, size_t i)
+{
+	const char *data;
+
+	for (; i && i < file->nlines; i++) {
+		data = LINE_DATA(file, i - 1);
+		if (!file->lengths[i - 1] || data[file->lengths[i - 1] - 1] != '\\')
+			break;
+	}
+	return i;
+}
+
+
+/* Splits the file at logical line boundaries, so that lines never
+ * need to be looked at across chunks, and checks each chunk on a
+ * separate thread, with a separate context and a separate copy of
+ * the file, whose line table is a part of the file's line table,
+ * and whose line numbers are offset accordingly, and whose rewritten
+ * lines are kept separately. The diagnostics in each chunk are
+ * captured and merged, queue by queue, so that they are in the
+ * same order as if the file was checked on one thread */
+static int
+lint_chunks(struct makel *ctx, struct file *file, size_t nchunks)
+{
+	struct chunk *chunks;
+	struct rule_list rules;
+	size_t i, j, start, end;
+	int queue, failed = 0;
+
+	chunks = counted_calloc(nchunks, sizeof(*chunks));
+	if (!chunks)
+		return -1;
+
+	for (i = end = 0; i < nchunks; i++) {
+		start = end;
+		end = i + 1 == nchunks ? file->nlines : find_line_at(file, file->size / nchunks * (i + 1));
+		end = find_logical_line(file, MAX(start, end));
+
+		init_context(&chunks[i].ctx);
+		chunks[i].ctx.style = ctx->style;
+		memcpy(chunks[i].ctx.actions, ctx->actions, sizeof(ctx->actions));
+		chunks[i].ctx.capture = 1;
+		chunks[i].ctx.max_warnings = ctx->max_warnings;
+		chunks[i].ctx.stats = ctx->stats ? &chunks[i].stats : NULL;
+		chunks[i].ctx.follow_includes = ctx->follow_includes;
+		chunks[i].ctx.include_dir = ctx->include_dir;
+
+		chunks[i].file = *file;
+		chunks[i].file.extra = NULL;
+		chunks[i].file.extra_len = 0;
+		chunks[i].file.extra_size = 0;
+		chunks[i].file.line_offset = file->line_offset + start;
+		chunks[i].file.nlines = end - start;
+		chunks[i].file.offsets = &file->offsets[start];
+		chunks[i].file.lengths = &file->lengths[start];
+		chunks[i].file.flags = &file->flags[start];
+
+		/* The first chunk is checked on this thread, as is
+		 * any chunk for which a thread cannot be created */
+		if (i)
+			chunks[i].started = !pthread_create(&chunks[i].thread, NULL, lint_chunk, &chunks[i]);
+	}
+
+	lint_chunk(&chunks[0]);
+	for (i = 1; i < nchunks; i++) {
+		if (chunks[i].started)
+			pthread_join(chunks[i].thread, NULL);
+		else
+			lint_chunk(&chunks[i]);
+	}
+
+	for (queue = 0; queue < (int)ELEMSOF(ctx->deferred); queue++)
+		for (i = 0; i < nchunks; i++)
+			report_captured_diagnostics(ctx, &chunks[i].ctx, queue);
+
+	for (i = 0; i < nchunks; i++) {
+		ctx->exit_status = MAX(ctx->exit_status, chunks[i].ctx.exit_status);
+		for (j = 0; j < NUM_WARNING_CLASS; j++)
+			ctx->counts[j] += chunks[i].ctx.counts[j];
+		if (ctx->stats)
+			add_stats(ctx->stats, &chunks[i].stats);
+		ctx->followed_includes |= chunks[i].ctx.followed_includes;
+		ctx->include_levels = MAX(ctx->include_levels, chunks[i].ctx.include_levels);
+		ctx->include_limited |= chunks[i].ctx.include_limited;
+		merge_macros(ctx, chunks[i].ctx.macros.macros, chunks[i].ctx.macros.count);
+		ctx->macros.incomplete |= chunks[i].ctx.macros.incomplete;
+		get_rule_list(&chunks[i].ctx.graph, &rules);
+		merge_rules(ctx, &rules);
+		if (!failed && chunks[i].ctx.ndeps && add_deps(ctx, chunks[i].ctx.deps, chunks[i].ctx.ndeps))
+			failed = 1;
+		if (chunks[i].ctx.error && !ctx->error)
+			ctx->error = chunks[i].ctx.error;
+		if (!failed && chunks[i].failed) {
+			failed = 1;
+			errno = chunks[i].saved_errno;
+		}
+		if (!failed && merge_rewritten_lines(file, &chunks[i].file))
+			failed = 1;
+		free(chunks[i].file.extra);
+		destroy_context(&chunks[i].ctx);
+	}
+	free(chunks);
+	return failed ? -1 : 0;
+}
+
+
+/* If `relint` is not NULL, diagnostics are recorded, and lines that
+ * have not changed since the previous check are not checked again;
+ * on failure, -1 is returned and errno is set */
+int
+lint_file(struct makel *ctx, struct file *file, const struct relint *relint)
+{
+	size_t i, first, cont_from = 0;
+
+	ctx->recording = relint ? relint->record : NULL;
+
+	if (!file->nest_level) {
+		ctx->include_dir = get_include_dir(file->path);
+		prefetch_includes(ctx, file);
+	}
+
+	if (!relint && ctx->jobs > 1 && file->size / MIN_CHUNK_SIZE > 1) {
+		if (lint_chunks(ctx, file, MIN(ctx->jobs, file->size / MIN_CHUNK_SIZE)))
+			return -1;
+		goto out;
+	}
+
+	/* All checks are done in a single pass so that each line is
+	 * only brought into the cache once, but the diagnostics are
+	 * printed in the same order as if each check was done over
+	 * the whole file before the next check */
+	for (first = i = 0; i < file->nlines; i++) {
+		ctx->line = i;
+
+		if (relint && relint->old_line[i] != SIZE_MAX) {
+			/* Neither the line nor its logical line has changed, so
+			 * the checks would report the same as last time; but
+			 * the line continuation must be found for later lines,
+			 * and is removed at the end of the file, as when checked;
+			 * test cases: tests/relint.c */
+			set_line_continuation_joiner(file, i);
+			if (file->flags[i] & LINE_EOF)
+				file->flags[i] &= (unsigned char)~(LINE_CONTINUED | LINE_CMD_JOINER);
+			replay_diagnostics(ctx, relint->previous, relint->old_line[i], file->path);
+			if (!(file->flags[i] & LINE_CONTINUED)) {
+				/* Macros and rules are only known for the whole makefile */
+				scan_macros(ctx, file, first, 0);
+				scan_rules(ctx, file, first);
+				defer_diagnostics(ctx, 2);
+				follow_include_line(ctx, file, first);
+				defer_diagnostics(ctx, 0);
+				first = i + 1;
+			}
+			continue;
+		}
+
+		if (lint_line(ctx, file, i, &first, &cont_from)) {
+			ctx->recording = NULL;
+			return -1;
+		}
+	}
+	flush_deferred_diagnostics(ctx);
+
+out:
+	/* An included file's macros and rules are reported with the includer's */
+	if (!file->nest_level) {
+		report_graph_warnings(ctx);
+		report_macro_warnings(ctx);
+	}
+	if (ctx->error) {
+		errno = ctx->error;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Like lint_file(), but the file is read as it is checked, and only
+ * the current logical line is kept in memory; the diagnostics are
+ * therefore printed in the same order as if each check was done on
+ * a logical line before the next check, rather than on the whole
+ * file; on failure, -1 is returned and errno is set */
+int
+lint_stream(struct makel *ctx, struct text_stream *stream)
+{
+	struct file *file = &stream->file;
+	struct timespec timer;
+	size_t i, first = 0, cont_from = 0;
+	int r;
+
+	ctx->recording = NULL;
+	if (!file->nest_level)
+		ctx->include_dir = get_include_dir(file->path);
+
+	for (;;) {
+		BEGIN_PHASE(ctx, &timer);
+		r = read_text_line(ctx, stream);
+		END_PHASE(ctx, &timer, PHASE_LOAD, r > 0, r > 0 ? file->lengths[file->nlines - 1] : 0);
+		if (r <= 0)
+			break;
+		i = file->nlines - 1;
+		check_line_length(ctx, file, i);
+		if (lint_line(ctx, file, i, &first, &cont_from))
+			return -1;
+		if (!(file->flags[i] & LINE_CONTINUED)) {
+			/* Line continuations are never checked
+			 * across logical lines, so earlier lines
+			 * are no longer needed */
+			flush_deferred_diagnostics(ctx);
+			drop_text_lines(stream);
+			first = 0;
+		}
+	}
+	flush_deferred_diagnostics(ctx);
+
+	if (r < 0)
+		return -1;
+	if (!file->nest_level) {
+		report_graph_warnings(ctx);
+		report_macro_warnings(ctx);
+	}
+	if (ctx->error) {
+		errno = ctx->error;
+		return -1;
+	}
+	return 0;
+}
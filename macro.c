@@ -0,0 +1,312 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Every macro that is defined or referenced in a run is in the
+ * context's macro table, in the order they were first seen, which
+ * is the order diagnostics about them are reported in. Macros in
+ * included files are merged into the table of the including
+ * makefile, so that a macro can be defined in one file and used
+ * in another. */
+
+
+/* Macros that make(1) defines itself, or that its default
+ * rules use, so they are neither undefined nor unused */
+static const char *const predefined_macros[] = {
+	"@", "%", "?", "<", "*",
+	"@D", "%D", "?D", "<D", "*D",
+	"@F", "%F", "?F", "<F", "*F",
+	"MAKE", "MAKEFLAGS", "SHELL",
+	"AR", "ARFLAGS", "CC", "CFLAGS", "FC", "FFLAGS", "GET", "GFLAGS",
+	"LDFLAGS", "LEX", "LFLAGS", "SCCSFLAGS", "SCCSGETFLAGS", "YACC", "YFLAGS"
+};
+
+void
+clear_macro_table(struct macro_table *table)
+{
+	clear_name_table(&table->names);
+	table->count = 0;
+	table->incomplete = 0;
+}
+
+
+void
+destroy_macro_table(struct macro_table *table)
+{
+	destroy_name_table(&table->names);
+	free(table->macros);
+}
+
+
+/* Returns the macro, which is added if it is not in the
+ * table, or NULL (and ctx->error is set) on failure */
+static struct macro *
+get_macro(struct makel *ctx, const char *name, size_t len)
+{
+	struct macro_table *table = &ctx->macros;
+	struct macro *m;
+	size_t id, size;
+	void *new;
+
+	id = add_name(&table->names, name, len);
+	if (id == SIZE_MAX)
+		goto fail;
+	if (id < table->count)
+		return &table->macros[id];
+
+	if (table->count == table->size) {
+		size = table->size ? table->size * 2 : 512;
+		new = counted_realloc(table->macros, size * sizeof(*table->macros));
+		if (!new)
+			goto fail;
+		table->macros = new;
+		table->size = size;
+	}
+	m = &table->macros[table->count++];
+	m->name = table->names.names[id].str;
+	m->len = len;
+	m->def_path = NULL;
+	m->def_line = 0;
+	m->ref_path = NULL;
+	m->ref_line = 0;
+	return m;
+
+fail:
+	if (!ctx->error)
+		ctx->error = errno;
+	return NULL;
+}
+
+
+static void
+add_macro(struct makel *ctx, const char *name, size_t len, const char *path, size_t line, int definition)
+{
+	struct macro *m = get_macro(ctx, name, len);
+
+	if (!m)
+		return;
+	if (definition && !m->def_path) {
+		m->def_path = path;
+		m->def_line = line;
+	} else if (!definition && !m->ref_path) {
+		m->ref_path = path;
+		m->ref_line = line;
+	}
+}
+
+
+/* Returns the length of the macro name, if the line is a
+ * macro definition; a name that contains a macro expansion
+ * is not recognised, as we do not expand macros */
+size_t
+parse_macro_definition(const char *s, size_t len)
+{
+	size_t i = 0, n;
+
+	while (i < len && !isblank(s[i]) && !strchr("=:?+!#$", s[i]))
+		i++;
+	if (!i)
+		return 0;
+	n = i;
+	while (i < len && isblank(s[i]))
+		i++;
+	if (i < len && strchr("?+!", s[i])) {
+		i++;
+	} else {
+		/* "=", ":=", "::=", or ":::=" */
+		while (i < len && i - n < 4 && s[i] == ':')
+			i++;
+	}
+	return i < len && s[i] == '=' ? n : 0;
+}
+
+
+/* Returns the offset of the closing bracket of a macro expansion
+ * beginning at s[0], or len if it is not closed; *name_lenp is set
+ * to the length of the name (what is before any substitution) */
+static size_t
+find_closing_bracket(const char *s, size_t len, size_t *name_lenp)
+{
+	char open = s[0], close = open == '(' ? ')' : '}';
+	size_t i, depth = 0;
+
+	*name_lenp = 0;
+	for (i = 1; i < len; i++) {
+		if (s[i] == open) {
+			depth++;
+		} else if (s[i] == close) {
+			if (!depth--)
+				break;
+		} else if (s[i] == ':' && !depth && !*name_lenp) {
+			*name_lenp = i - 1;
+		}
+	}
+	if (!*name_lenp)
+		*name_lenp = i - 1;
+	return i;
+}
+
+
+static void
+scan_macro_references(struct makel *ctx, struct file *file, size_t i, const char *s, size_t len, int warn)
+{
+	size_t j, end, name_len;
+	const char *name;
+
+	for (j = 0; j < len; j++) {
+		if (s[j] != '$' || ++j == len || s[j] == '$')
+			continue;
+		if (s[j] != '(' && s[j] != '{') {
+			add_macro(ctx, &s[j], 1, file->path, LINE_NUMBER(file, i), 0);
+			continue;
+		}
+
+		end = j + find_closing_bracket(&s[j], len - j, &name_len);
+		name = &s[j + 1];
+		if (end == len) {
+			/* Not closed on this line, the rest is checked as if it
+			 * was not a macro expansion, in case it is a <dollar-sign>
+			 * that should have been escaped */
+			continue;
+		}
+		if (memchr(name, '$', name_len)) {
+			/* The name is computed, we can only see the macros it
+			 * uses, so any macro could be used; test cases:
+			 * computed_macro_name.mk */
+			ctx->macros.incomplete = 1;
+			scan_macro_references(ctx, file, i, name, end - j - 1, warn);
+		} else if (name_len) {
+			add_macro(ctx, name, name_len, file->path, LINE_NUMBER(file, i), 0);
+			if (end - j - 1 > name_len) /* The substitution may use macros */
+				scan_macro_references(ctx, file, i, &name[name_len], end - j - 1 - name_len, warn);
+		}
+
+		if (warn && ctx->style.macro_bracket_style != INCONSISTENT &&
+		    (s[j] == '(') != (ctx->style.macro_bracket_style == ROUND)) {
+			/* test cases: macro_bracket.mk */
+			warnf_style(ctx, WC_MACRO_BRACKET, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+			            "macro expansion uses %s rather than %s",
+			            s[j] == '(' ? "$(...)" : "${...}", s[j] == '(' ? "${...}" : "$(...)");
+		}
+		j = end;
+	}
+}
+
+
+/* Records the macros defined and referenced in a logical line, that
+ * begins at line i; only bracket style is checked here, as it is not
+ * known whether a macro is defined or used until the end of the run,
+ * so unless `warn` is set, the line is only scanned */
+void
+scan_macros(struct makel *ctx, struct file *file, size_t i, int warn)
+{
+	const char *data = LINE_DATA(file, i), *s = data, *end = &data[file->lengths[i]];
+	struct logical_line line;
+	struct span span;
+	size_t name_len;
+
+	while (s != end && isspace(*s))
+		s++;
+	if (s == end || *s == '#')
+		return;
+
+	if (data[0] != '\t') {
+		name_len = parse_macro_definition(s, (size_t)(end - s));
+		if (name_len)
+			add_macro(ctx, s, name_len, file->path, LINE_NUMBER(file, i), 1);
+	}
+
+	open_logical_line(&line, file, i);
+	while (next_span(&line, &span))
+		scan_macro_references(ctx, file, span.line, span.s, span.len, warn);
+}
+
+
+/* Adds macros from another table, keeping the earliest
+ * locations, as the other table is for later lines */
+void
+merge_macros(struct makel *ctx, const struct macro *macros, size_t n)
+{
+	struct macro *m;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		m = get_macro(ctx, macros[i].name, macros[i].len);
+		if (!m)
+			return;
+		if (!m->def_path) {
+			m->def_path = macros[i].def_path;
+			m->def_line = macros[i].def_line;
+		}
+		if (!m->ref_path) {
+			m->ref_path = macros[i].ref_path;
+			m->ref_line = macros[i].ref_line;
+		}
+	}
+}
+
+
+/* Returns a copy of the macros, in one allocation with their names,
+ * so that they outlive the table, or NULL on failure; the locations
+ * must also outlive the table, as they are not copied */
+struct macro *
+export_macros(const struct macro_table *table)
+{
+	struct macro *macros;
+	size_t i, names_size = 0;
+	char *p;
+
+	for (i = 0; i < table->count; i++)
+		names_size += table->macros[i].len;
+	macros = counted_malloc(table->count * sizeof(*macros) + names_size + 1);
+	if (!macros)
+		return NULL;
+	p = (char *)&macros[table->count];
+	for (i = 0; i < table->count; i++) {
+		macros[i] = table->macros[i];
+		macros[i].name = memcpy(p, table->macros[i].name, table->macros[i].len);
+		p += table->macros[i].len;
+	}
+	return macros;
+}
+
+
+static int
+is_predefined_macro(const struct macro *m)
+{
+	size_t i;
+
+	for (i = 0; i < ELEMSOF(predefined_macros); i++)
+		if (strlen(predefined_macros[i]) == m->len && !memcmp(predefined_macros[i], m->name, m->len))
+			return 1;
+	return 0;
+}
+
+
+/* Called at the end of a run, when every macro in the makefile
+ * and the files it includes is known; a macro may also be defined
+ * in the environment or on the command line of make(1), and used
+ * by a recursive make(1), so these are only informational; nothing
+ * is reported if an include line was not followed, as the file could
+ * define or use any macro, or if a macro name is computed */
+void
+report_macro_warnings(struct makel *ctx)
+{
+	const struct macro *m;
+	size_t i;
+
+	if (ctx->macros.incomplete)
+		return;
+	for (i = 0; i < ctx->macros.count; i++) {
+		m = &ctx->macros.macros[i];
+		if ((m->def_path && m->ref_path) || is_predefined_macro(m))
+			continue;
+		if (m->ref_path) {
+			warnf_warning(ctx, WC_UNDEFINED_MACRO, m->ref_path, m->ref_line, m->ref_line,
+			              "macro %.*s is used but not defined in the makefile", (int)m->len, m->name);
+		} else {
+			warnf_warning(ctx, WC_UNUSED_MACRO, m->def_path, m->def_line, m->def_line,
+			              "macro %.*s is defined but not used in the makefile", (int)m->len, m->name);
+		}
+	}
+}
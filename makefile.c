@@ -9,7 +9,7 @@ static const char *const default_makefiles[] = {
 
 
 int
-open_default_makefile(const char **pathp)
+open_default_makefile(struct makel *ctx, const char **pathp)
 {
 	int fd;
 	size_t i;
@@ -25,7 +25,7 @@ open_default_makefile(const char **pathp)
 		*pathp = default_makefiles[i];
 		fd = open(*pathp, O_RDONLY);
 		if (fd >= 0) {
-			printinfof(WC_MAKEFILE, "found standard makefile to use: %s", *pathp);
+			printinfof(ctx, WC_MAKEFILE, "found standard makefile to use: %s", *pathp);
 			goto find_existing_fallbacks;
 		} else if (errno != ENOENT) {
 			eprintf("found standard makefile to use, but failed to open: %s:", *pathp);
@@ -51,7 +51,7 @@ find_existing_fallbacks:
 	 */
 	for (i++; i < ELEMSOF(default_makefiles); i++)
 		if (!access(default_makefiles[i], F_OK))
-			warnf_confusing(WC_EXTRA_MAKEFILE,
+			warnf_confusing(ctx, WC_EXTRA_MAKEFILE, NULL, 0, 0,
 			                "found additional standard makefile, this be confusing: %s",
 			                default_makefiles[i]);
 
@@ -59,45 +59,54 @@ find_existing_fallbacks:
 }
 
 
+int
+is_default_makefile_name(const char *name)
+{
+	size_t i;
+	for (i = 0; i < ELEMSOF(default_makefiles); i++)
+		if (!strcmp(name, default_makefiles[i]))
+			return 1;
+	return 0;
+}
+
+
 void
-cmdline_opt_f(const char *arg, const char **makefile_pathp)
+cmdline_opt_f(struct makel *ctx, const char *arg, const char **makefile_pathp)
 {
 	static int warning_emitted = 0;
 
 	if (*makefile_pathp && !warning_emitted) {
 		warning_emitted = 1;
-		warnf_unspecified(WC_CMDLINE, "the -f option has been specified multiple times, "
-		                              "they are processed in order, but the behaviour is "
-	                                      "otherwise unspecified");
-		printinfof(WC_CMDLINE, "this implementation will use the last "
-		                       "option and discard earlier options");
+		warnf_unspecified(ctx, WC_CMDLINE, NULL, 0, 0,
+		                  "the -f option has been specified multiple times, "
+		                  "they are processed in order, but the behaviour is "
+		                  "otherwise unspecified");
+		printinfof(ctx, WC_CMDLINE, "this implementation will use the last "
+		                            "option and discard earlier options");
 	}
 
 	*makefile_pathp = arg;
 }
 
 
-struct line *
-load_makefile(const char *path, size_t *nlinesp)
+int
+open_makefile(struct makel *ctx, const char **pathp)
 {
-	struct line *lines;
 	int fd;
 
-	if (!path) {
-		fd = open_default_makefile(&path);
-	} else if (!strcmp(path, "-")) {
+	if (!*pathp) {
+		fd = open_default_makefile(ctx, pathp);
+	} else if (!strcmp(*pathp, "-")) {
 		/* “A pathname of '-' shall denote the standard input” */
 		fd = dup(STDIN_FILENO);
 		if (fd < 0)
 			eprintf("dup <stdin>:");
-		path = "<stdin>";
+		*pathp = "<stdin>";
 	} else {
-		fd = open(path, O_RDONLY);
+		fd = open(*pathp, O_RDONLY);
 		if (fd < 0)
-			eprintf("open %s O_RDONLY:", path);
+			eprintf("open %s O_RDONLY:", *pathp);
 	}
 
-	lines = load_text_file(fd, path, 0, nlinesp);
-	close(fd);
-	return lines;
+	return fd;
 }
@@ -5,243 +5,196 @@ const char *argv0 = "makel";
 
 static void
 usage(void) {
-	fprintf(stderr, "%s [-f makefile]\n", argv0);
+	fprintf(stderr, "%s [-t] [-c cachedir] [-F format] [-j jobs] [-n max] [-f makefile]\n"
+	                "%s -u [-t] [-F format] [-n max] [-f makefile]\n"
+	                "%s -b [-t] [-c cachedir] [-F format] [-j jobs] [-n max] [makefile] ...\n"
+	                "%s -m [-c cachedir] [-F format] [-j jobs] [-n max] [makefile] ...\n"
+	                "%s -r directory ... [-t] [-c cachedir] [-F format] [-g pattern] ... [-j jobs] [-n max] [makefile] ...\n"
+	                "%s -s socket [-c cachedir] [-j jobs] [-n max]\n"
+	                "%s -S socket [-f makefile]\n",
+	        argv0, argv0, argv0, argv0, argv0, argv0, argv0);
 	exit(EXIT_ERROR);
 }
 
 
-int exit_status = 0;
-
-struct style style = {
-	.max_line_length = 120,
-	.only_empty_blank_lines = 1,
-	.macro_bracket_style = ROUND
-};
-
-
-static void
-set_line_continuation_joiner(struct line *line)
-{
-	if (line->len && line->data[line->len - 1] == '\\') {
-		line->data[--line->len] = '\0';
-		/* Doesn't matter here if the first non-white space is # */
-		line->continuation_joiner = line->data[0] == '\t' ? '\\' : ' ';
-	} else {
-		line->continuation_joiner = '\0';
-	}
-}
-
-
-static void
-check_line_continuations(struct line *lines, size_t nlines)
+int
+main(int argc, char *argv[])
 {
-	size_t i, cont_from = 0;
-
-	for (i = 0; i < nlines; i++) {
-		set_line_continuation_joiner(&lines[i]);
-
-		if (lines[i].continuation_joiner &&
-		    (!i || !lines[i - 1].continuation_joiner) &&
-		    is_line_blank(&lines[i])) {
-			/* test cases: cont_of_blank.mk */
-			warnf_confusing(WC_CONTINUATION_OF_BLANK,
-			                "%s:%zu: initial line continuation on otherwise blank line, can cause confusion",
-			                lines[i].path, lines[i].lineno);
-		}
+	const char *path = NULL, *arg, *serve_socket = NULL, *client_socket = NULL;
+	struct makel ctx;
+	struct output out;
+	int batch = 0, watch = 0, stream = 0, limited = 0, stats = 0, status, fd, saved_errno;
+	size_t jobs = 0;
+	char **paths, *end;
+	size_t npaths;
+	const char **dirs, **patterns;
+	size_t ndirs = 0, npatterns = 0;
+
+	/* Diagnostics printed to stderr are buffered */
+	atexit(flush_output);
+	init_output(&out, stderr);
+	init_cli_context(&ctx, &out);
+	dirs = ecalloc((size_t)argc + 1, sizeof(*dirs));
+	patterns = ecalloc((size_t)argc + 1, sizeof(*patterns));
 
-		if (!lines[i].continuation_joiner &&
-		    i && lines[i - 1].continuation_joiner &&
-		    is_line_blank(&lines[i])) {
-			/* test cases: cont_to_blank.mk */
-			warnf_confusing(WC_CONTINUATION_TO_BLANK,
-			                "%s:%zu: terminal line continuation to blank line, can cause confusion",
-			                lines[i].path, lines[i].lineno);
-		}
+	/* make(1) shall support mixing of options and operands (up to --) */
+	ARGBEGIN {
+	case 'b':
+		batch = 1;
+		break;
 
-		if (lines[i].continuation_joiner && lines[i].eof) {
-			/* test cases: eof_cont.mk (TODO with lines[i].nest_level) */
-			warnf_unspecified(WC_EOF_LINE_CONTINUATION,
-			                  "%s:%zu: line continuation at end of file, causes unspecified behaviour%s",
-			                  lines[i].path, lines[i].lineno,
-			                  !lines[i].nest_level ? "" :
-			                  ", it is especially problematic in an included line");
-			printinfof(WC_EOF_LINE_CONTINUATION, "this implementation will remove the line continuation");
-			lines[i].continuation_joiner = 0;
-		}
+	case 'c':
+		cache_dir = ARG();
+		break;
 
-		if (i && lines[i - 1].continuation_joiner && lines[i].len) {
-			if (!isspace(lines[i].data[0])) {
-				if (lines[cont_from].len && !isspace(lines[cont_from].data[lines[cont_from].len - 1])) {
-					/* test cases: cont_without_ws.mk (TODO with i != cont_from + 1) */
-					warnf_confusing(WC_SPACELESS_CONTINUATION,
-					                "%s:%zu,%zu: <backslash> is proceeded by a non-white space "
-					                "character at the same time as the next line%s begins with "
-					                "a non-white space character, this can cause confusion as "
-					                "the make utility will add a whitespace",
-					                lines[cont_from].path, lines[cont_from].lineno,
-					                lines[i].lineno, i == cont_from + 1 ? "" :
-					                ", that consist of not only a <backslash>,");
-				}
-				/* test cases: unindented_cont.mk, cont_without_ws.mk */
-				warnf_confusing(WC_UNINDENTED_CONTINUATION,
-				                "%s:%zu: continuation of line is not indented, can cause confusion",
-				                lines[i].path, lines[i].lineno);
-			}
-			cont_from = i;
-		} else if (lines[i].continuation_joiner) {
-			cont_from = i;
-		}
-	}
-}
+	case 'f':
+		cmdline_opt_f(&ctx, ARG(), &path);
+		break;
 
+	case 'F':
+		arg = ARG();
+		if (!strcmp(arg, "text"))
+			output_format = FORMAT_TEXT;
+		else if (!strcmp(arg, "jsonl"))
+			output_format = FORMAT_JSONL;
+		else if (!strcmp(arg, "sarif"))
+			output_format = FORMAT_SARIF;
+		else
+			usage();
+		break;
 
-static enum line_class
-classify_line(struct line *line)
-{
-	int warned_bad_space = 0;
-	char *s;
-
-	if (!line->len)
-		return EMPTY;
-
-start_over:
-	s = line->data;
-
-	while (isspace(*s)) {
-		if (!warned_bad_space && !isblank(*s)) {
-			warned_bad_space = 1;
-			/* test cases: bad_ws.mk, noninitial_bad_ws.mk */
-			warnf_undefined(WC_LEADING_BAD_SPACE,
-			                "%s:%zu: line contains leading white space other than "
-		        	        "<space> and <tab>, which causes undefined behaviour",
-			                line->path, line->lineno);
-			/* TODO what do we do here? */
-		}
-		s++;
-	}
+	case 'g':
+		patterns[npatterns++] = ARG();
+		break;
 
-	if (*s == '#') {
-		if (line->data[0] != '#') {
-			/* TODO should not apply if command line */
-			/* test cases: ws_before_comment.mk */
-			warnf_undefined(WC_ILLEGAL_INDENT,
-			                "%s:%zu: comment has leading white space, which is not legal",
-			                line->path, line->lineno);
-			printinfof(WC_ILLEGAL_INDENT, "this implementation will recognise it as a comment line");
-		}
-		return COMMENT;
+	case 'j':
+		arg = ARG();
+		errno = 0;
+		jobs = isdigit(*arg) ? (size_t)strtoul(arg, &end, 10) : 0;
+		if (errno || !jobs || *end)
+			usage();
+		break;
 
-	} else if (!*s) {
-		if (line->continuation_joiner) {
-			line++;
-			goto start_over;
-		}
-		return BLANK;
+	case 'm':
+		watch = 1;
+		break;
 
-	} else if (line->data[0] == '\t') {
-		return COMMAND_LINE;
+	case 'n':
+		arg = ARG();
+		errno = 0;
+		max_warnings = isdigit(*arg) ? (size_t)strtoul(arg, &end, 10) : 0;
+		if (errno || !isdigit(*arg) || *end)
+			usage();
+		ctx.max_warnings = max_warnings;
+		limited = 1;
+		break;
 
-	} else {
-		if (*s == '-') { /* We will warn about this later */
-			s++;
-			while (isspace(*s))
-				s++;
-		}
+	case 'r':
+		dirs[ndirs++] = ARG();
+		break;
 
-		/* TODO unspecified behaviour if include line with <backslash> */
-		/* TODO unspecified behaviour if continuation that looks like an include line */
-		return OTHER;
-	}
-}
+	case 's':
+		serve_socket = ARG();
+		break;
 
+	case 'S':
+		client_socket = ARG();
+		break;
 
-int
-main(int argc, char *argv[])
-{
-	const char *path = NULL;
-	struct line *lines;
-	size_t nlines;
-	size_t i;
+	case 't':
+		stats = 1;
+		break;
 
-	/* make(1) shall support mixing of options and operands (up to --) */
-	ARGBEGIN {
-	case 'f':
-		cmdline_opt_f(ARG(), &path);
+	case 'u':
+		stream = 1;
 		break;
 
 	default:
 		usage();
 	} ARGEND;
 
-	if (argc)
+	if (stream && (batch || ndirs || serve_socket || client_socket || watch || cache_dir || jobs))
+		usage();
+	if (serve_socket ? (batch || ndirs || path || npatterns || client_socket || watch || argc) :
+	    client_socket ? (batch || ndirs || npatterns || cache_dir || jobs || limited || watch || argc) :
+	    watch ? (batch || ndirs || path || npatterns) :
+	    ndirs ? (batch || path) : batch ? (path || npatterns) : (argc || npatterns))
+		usage();
+	/* The server's responses and the watch mode's output are
+	 * not one document, so they cannot be a SARIF log */
+	if (output_format != FORMAT_TEXT && (serve_socket || client_socket || (watch && output_format == FORMAT_SARIF)))
+		usage();
+	/* The statistics are printed at exit, after the SARIF log */
+	if (stats && (serve_socket || client_socket || watch || output_format == FORMAT_SARIF))
 		usage();
 
 	setlocale(LC_ALL, ""); /* Required by wcwidth(3) */
 
-	lines = load_makefile(path, &nlines);
+	/* Registered after flush_output, so that it is called before it */
+	if (output_format == FORMAT_SARIF) {
+		print_sarif_header(ctx.actions);
+		atexit(print_sarif_footer);
+	}
+	if (stats) {
+		start_stats();
+		ctx.stats = ecalloc(1, sizeof(*ctx.stats));
+		atexit(print_stats);
+	}
 
-	for (i = 0; i < nlines; i++) {
-		check_utf8_encoding(&lines[i]);
-		check_column_count(&lines[i]);
+	if (serve_socket)
+		return serve(serve_socket, jobs);
+
+	if (client_socket) {
+		/* The server does not know our working directory, so
+		 * the default makefile must be found by the client */
+		if (!path)
+			close(open_default_makefile(&ctx, &path));
+		end_output(&out);
+		return lint_via_server(client_socket, path);
 	}
 
-	check_line_continuations(lines, nlines);
-
-	for (i = 0; i < nlines; i++) {
-		switch (classify_line(&lines[i])) {
-		case EMPTY:
-			break;
-
-		case BLANK:
-			if (style.only_empty_blank_lines) {
-				warnf_style(WC_NONEMPTY_BLANK, "%s:%zu: line is blank but not empty", /* TODO test cases */
-				            lines[i].path, lines[i].lineno);
-			}
-			break;
-
-		case COMMENT:
-			break;
-
-		case COMMAND_LINE:
-			/* TODO list may, for historical reasons, end at a comment line;
-			 *      note, the specifications specify “comment line” which is
-			 *      define to include empty and blank lines; note however
-			 *      that a line that begins with a <hash> that is prefixed
-			 *      by whitespace is not a comment line, so, if it begins
-			 *      with <tab> followed by zero or more whitespace, and then
-			 *      a <hash>, it a command line, not a comment line. */
-			/* TODO on line continuation, remove first '\t', if any, and join with '\\\n' */
-		case OTHER:
-			/* TODO first non-comment line shall be special target .POSIX without
-			 *      prerequisites or commands, behaviour is unspecified otherwise */
-			/* TODO on line continuation, remove leading white space and join with ' ' */
-			break;
-
-		default:
-			abort();
+	if (watch) {
+		if (!argc) {
+			close(open_default_makefile(&ctx, &path));
+			end_output(&out);
+			return watch_files(&path, 1, jobs);
 		}
+		return watch_files((const char *const *)argv, (size_t)argc, jobs);
+	}
+
+	if (ndirs) {
+		return lint_trees(dirs, ndirs, (const char *const *)argv, (size_t)argc,
+		                  patterns, npatterns, jobs);
+	}
 
-		while (lines[i].continuation_joiner) {
-			if (memchr(lines[i].data, '#', lines[i].len)) { /* TODO could also be a non-standard internal macro */
-				/* test cases: comment_cont.mk */
-				warnf_confusing(WC_COMMENT_CONTINUATION,
-				                "%s:%zu: using continuation of line to continue "
-				                "a comment on the next line can cause confusion",
-				                lines[i].path, lines[i].lineno);
-			}
-			i += 1;
+	if (batch) {
+		/* Files are either listed as operands, or NUL-separated on stdin */
+		if (argc) {
+			paths = argv;
+			npaths = (size_t)argc;
+		} else {
+			paths = read_path_list(STDIN_FILENO, &npaths);
 		}
-		/* TODO # in comment lines are very problematic. In make(1)
-		 *      a comment can have a line continuation, but in sh(1)
-		 *      comments cannot have line continuation. Furthermore,
-		 *      any #, even if there is a be backslashed or in quotes,
-		 *      becomes a comment; because of this, some implementations
-		 *      of make do not recognise comments in command lines and
-		 *      instead rely on sh(1) ignoring comments (this however
-		 *      breaks POSIX compliance). */
-		/* TODO check if a # appears inside quotes or after a backslash */
+		return lint_batch((const char *const *)paths, npaths, jobs, NULL);
 	}
 
-	free(lines);
-	return exit_status;
+	/* A large makefile is split into parts that are checked in parallel */
+	ctx.jobs = jobs ? jobs : default_job_count();
+	fd = open_makefile(&ctx, &path);
+	if (stream) {
+		status = makel_lint_stream(&ctx, fd, path);
+		end_output(&out);
+	} else {
+		status = lint_fd_cached(&ctx, fd, path, &out);
+	}
+	/* The statistics of the run are added to the totals,
+	 * that are printed at exit, even if the run failed */
+	saved_errno = errno;
+	close(fd);
+	destroy_cli_context(&ctx);
+	if (status < 0) {
+		errno = saved_errno;
+		eprintf("%s:", path);
+	}
+	return status;
 }
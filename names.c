@@ -0,0 +1,167 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* A name table gives each distinct name an ID, which is its index
+ * in .names, in the order the names were added, so that what is
+ * known about a name can be kept in plain arrays; the hash table
+ * is an open addressing table of IDs, so it can grow without moving
+ * the names, and the names are kept in large blocks, as there can
+ * be hundreds of thousands of them in generated makefiles. */
+
+
+#define NAME_BLOCK_SIZE (64 << 10)
+
+struct name_block {
+	struct name_block *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+
+/* FNV-1a, names are short, so hashing them byte by byte is cheap */
+static size_t
+hash_name(const char *s, size_t len)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * UINT64_C(1099511628211);
+	return (size_t)(h ^ (h >> 32));
+}
+
+
+void
+clear_name_table(struct name_table *table)
+{
+	struct name_block *block;
+
+	while ((block = table->blocks)) {
+		table->blocks = block->next;
+		free(block);
+	}
+	if (table->count)
+		memset(table->slots, 0, table->nslots * sizeof(*table->slots));
+	table->count = 0;
+}
+
+
+void
+destroy_name_table(struct name_table *table)
+{
+	clear_name_table(table);
+	free(table->names);
+	free(table->slots);
+}
+
+
+/* Returns NULL on failure */
+static const char *
+copy_name(struct name_table *table, const char *s, size_t len)
+{
+	struct name_block *block = table->blocks;
+	size_t size;
+
+	if (!block || len > block->size - block->used) {
+		size = MAX(NAME_BLOCK_SIZE, len);
+		block = counted_malloc(offsetof(struct name_block, data) + size);
+		if (!block)
+			return NULL;
+		block->used = 0;
+		block->size = size;
+		block->next = table->blocks;
+		table->blocks = block;
+	}
+	memcpy(&block->data[block->used], s, len);
+	block->used += len;
+	return &block->data[block->used - len];
+}
+
+
+static int
+grow_slots(struct name_table *table)
+{
+	size_t nslots = table->nslots ? table->nslots * 2 : 1024, i, j;
+	size_t *slots;
+
+	slots = counted_calloc(nslots, sizeof(*slots));
+	if (!slots)
+		return -1;
+	for (i = 0; i < table->count; i++) {
+		for (j = table->names[i].hash & (nslots - 1); slots[j]; j = (j + 1) & (nslots - 1));
+		slots[j] = i + 1;
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->nslots = nslots;
+	return 0;
+}
+
+
+/* Returns the ID of a name, or SIZE_MAX if it is not in the table;
+ * *slotp is set to where it would be added */
+static size_t
+lookup_name(const struct name_table *table, const char *s, size_t len, size_t hash, size_t *slotp)
+{
+	const struct name *name;
+	size_t j;
+
+	for (j = hash & (table->nslots - 1); table->slots[j]; j = (j + 1) & (table->nslots - 1)) {
+		name = &table->names[table->slots[j] - 1];
+		if (name->hash == hash && name->len == len && !memcmp(name->str, s, len))
+			return table->slots[j] - 1;
+	}
+	*slotp = j;
+	return SIZE_MAX;
+}
+
+
+/* Returns the ID of a name, or SIZE_MAX if it is not in the table */
+size_t
+find_name(const struct name_table *table, const char *s, size_t len)
+{
+	size_t slot;
+	if (!table->nslots)
+		return SIZE_MAX;
+	return lookup_name(table, s, len, hash_name(s, len), &slot);
+}
+
+
+/* Returns the ID of a name, which is .count before the call if the
+ * name is added, or SIZE_MAX (and errno is set) on failure */
+size_t
+add_name(struct name_table *table, const char *s, size_t len)
+{
+	size_t h = hash_name(s, len), id, slot = 0, size;
+	const char *str;
+	void *new;
+
+	if (table->nslots) {
+		id = lookup_name(table, s, len, h, &slot);
+		if (id != SIZE_MAX)
+			return id;
+	}
+
+	if ((table->count + 1) * 2 > table->nslots) {
+		if (grow_slots(table))
+			return SIZE_MAX;
+		lookup_name(table, s, len, h, &slot);
+	}
+	if (table->count == table->size) {
+		size = table->size ? table->size * 2 : 512;
+		new = counted_realloc(table->names, size * sizeof(*table->names));
+		if (!new)
+			return SIZE_MAX;
+		table->names = new;
+		table->size = size;
+	}
+	str = copy_name(table, s, len);
+	if (!str)
+		return SIZE_MAX;
+
+	table->names[table->count].str = str;
+	table->names[table->count].len = len;
+	table->names[table->count].hash = h;
+	table->slots[slot] = table->count + 1;
+	return table->count++;
+}
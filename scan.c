@@ -0,0 +1,234 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+# define HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+
+/* Processes a machine word at a time, which is good enough
+ * for architectures we do not have a vectorised version for */
+static size_t
+ascii_span_scalar(const char *s, size_t n)
+{
+	uint_least64_t word;
+	size_t i = 0;
+
+	for (; n - i >= sizeof(word); i += sizeof(word)) {
+		memcpy(&word, &s[i], sizeof(word));
+		if (word & UINT64_C(0x8080808080808080))
+			break;
+	}
+	while (i < n && !(s[i] & 0x80))
+		i++;
+	return i;
+}
+
+
+/* Like ascii_span_scalar(), but finds the first <newline> or NUL byte */
+static size_t
+find_newline_or_nul_scalar(const char *s, size_t n)
+{
+	uint_least64_t word, lf;
+	const uint_least64_t ones = UINT64_C(0x0101010101010101);
+	const uint_least64_t highs = UINT64_C(0x8080808080808080);
+	size_t i = 0;
+
+	/* (x - ones) & ~x & highs is non-zero iff x contains a zero byte */
+	for (; n - i >= sizeof(word); i += sizeof(word)) {
+		memcpy(&word, &s[i], sizeof(word));
+		lf = word ^ (ones * '\n');
+		if (((word - ones) & ~word & highs) | ((lf - ones) & ~lf & highs))
+			break;
+	}
+	while (i < n && s[i] != '\n' && s[i])
+		i++;
+	return i;
+}
+
+
+/* Like find_newline_or_nul_scalar(), but finds the first byte that is
+ * in `set`, which is a NUL-terminated string of at most a few bytes */
+static size_t
+find_any_byte_scalar(const char *s, size_t n, const char *set)
+{
+	uint_least64_t word, x, found;
+	const uint_least64_t ones = UINT64_C(0x0101010101010101);
+	const uint_least64_t highs = UINT64_C(0x8080808080808080);
+	size_t i = 0, k;
+
+	for (; n - i >= sizeof(word); i += sizeof(word)) {
+		memcpy(&word, &s[i], sizeof(word));
+		found = 0;
+		for (k = 0; set[k]; k++) {
+			x = word ^ (ones * (unsigned char)set[k]);
+			found |= (x - ones) & ~x & highs;
+		}
+		if (found)
+			break;
+	}
+	while (i < n && (!s[i] || !strchr(set, s[i])))
+		i++;
+	return i;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+static size_t
+ascii_span_sse2(const char *s, size_t n)
+{
+	size_t i = 0;
+	unsigned mask;
+
+	for (; n - i >= 16; i += 16) {
+		mask = (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&s[i]));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + ascii_span_scalar(&s[i], n - i);
+}
+
+
+__attribute__((__target__("avx2")))
+static size_t
+ascii_span_avx2(const char *s, size_t n)
+{
+	size_t i = 0;
+	unsigned mask;
+
+	for (; n - i >= 32; i += 32) {
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)&s[i]));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + ascii_span_sse2(&s[i], n - i);
+}
+
+static size_t
+find_newline_or_nul_sse2(const char *s, size_t n)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v;
+	size_t i = 0;
+	unsigned mask;
+
+	for (; n - i >= 16; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&s[i]);
+		mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, nul)));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + find_newline_or_nul_scalar(&s[i], n - i);
+}
+
+
+__attribute__((__target__("avx2")))
+static size_t
+find_newline_or_nul_avx2(const char *s, size_t n)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v;
+	size_t i = 0;
+	unsigned mask;
+
+	for (; n - i >= 32; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+		                                                      _mm256_cmpeq_epi8(v, nul)));
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + find_newline_or_nul_sse2(&s[i], n - i);
+}
+
+
+static size_t
+find_any_byte_sse2(const char *s, size_t n, const char *set)
+{
+	__m128i v, found;
+	size_t i = 0, k;
+	unsigned mask;
+
+	for (; n - i >= 16; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&s[i]);
+		found = _mm_setzero_si128();
+		for (k = 0; set[k]; k++)
+			found = _mm_or_si128(found, _mm_cmpeq_epi8(v, _mm_set1_epi8(set[k])));
+		mask = (unsigned)_mm_movemask_epi8(found);
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + find_any_byte_scalar(&s[i], n - i, set);
+}
+
+
+__attribute__((__target__("avx2")))
+static size_t
+find_any_byte_avx2(const char *s, size_t n, const char *set)
+{
+	__m256i v, found;
+	size_t i = 0, k;
+	unsigned mask;
+
+	for (; n - i >= 32; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)&s[i]);
+		found = _mm256_setzero_si256();
+		for (k = 0; set[k]; k++)
+			found = _mm256_or_si256(found, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(set[k])));
+		mask = (unsigned)_mm256_movemask_epi8(found);
+		if (mask)
+			return i + (size_t)__builtin_ctz(mask);
+	}
+	return i + find_any_byte_sse2(&s[i], n - i, set);
+}
+
+#endif
+
+
+size_t
+ascii_span(const char *s, size_t n)
+{
+#ifdef HAVE_X86_SIMD
+	/* SSE2 is always available when __SSE2__ is defined,
+	 * but whether AVX2 is available must be checked at
+	 * runtime; the result is cached by the compiler's
+	 * runtime library, so this is only a load and a test */
+	if (n >= 32 && __builtin_cpu_supports("avx2"))
+		return ascii_span_avx2(s, n);
+	return ascii_span_sse2(s, n);
+#else
+	return ascii_span_scalar(s, n);
+#endif
+}
+
+
+size_t
+find_newline_or_nul(const char *s, size_t n)
+{
+#ifdef HAVE_X86_SIMD
+	if (n >= 32 && __builtin_cpu_supports("avx2"))
+		return find_newline_or_nul_avx2(s, n);
+	return find_newline_or_nul_sse2(s, n);
+#else
+	return find_newline_or_nul_scalar(s, n);
+#endif
+}
+
+
+/* Returns the offset of the first byte in s that is
+ * in `set`, which must not contain NUL, or n if none */
+size_t
+find_any_byte(const char *s, size_t n, const char *set)
+{
+#ifdef HAVE_X86_SIMD
+	if (n >= 32 && __builtin_cpu_supports("avx2"))
+		return find_any_byte_avx2(s, n, set);
+	return find_any_byte_sse2(s, n, set);
+#else
+	return find_any_byte_scalar(s, n, set);
+#endif
+}
@@ -0,0 +1,709 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* A request is a header line, "P <namelen> <pathlen>\n" to check the
+ * file at a path or "B <namelen> <datalen>\n" to check a makefile sent
+ * with the request, followed by the name of the file, as used in the
+ * diagnostics, and then the path or the makefile. A makefile that is
+ * being edited can instead be sent with "I <namelen> <datalen> <edits>\n",
+ * where <edits> is a space-separated list of "<line>,<old>,<new>", as
+ * in struct makel_edit, describing the changes since the last request
+ * with the same name, so that only the affected lines are checked;
+ * the whole makefile is checked if the last request with the name
+ * was not an "I" request, or was too long ago to be remembered.
+ * The response is a header line, "<exit status> <textlen>\n", followed
+ * by the diagnostics as makel(1) would print them. Any number of
+ * requests can be sent over one connection, and they are answered
+ * in order.
+ */
+
+#define MAX_NAME_LEN 4096
+
+/* The server keeps at most this many results and edited makefiles,
+ * forgetting the least recently used ones first, so that its memory
+ * use does not grow with every file it has ever been asked about */
+#define MAX_RESULTS 4096
+#define MAX_BUFFERS 64
+
+
+/* The result for a file is reused for as long as the file has
+ * not been replaced or modified */
+struct result {
+	struct result *next;
+	struct result *newer; /* In the order the results were last used */
+	struct result *older;
+	char *key; /* The name, a NUL byte, and the path */
+	size_t keylen;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	int status;
+	char *text;
+	size_t len;
+};
+
+/* The last check of a makefile that is being edited */
+struct buffer {
+	struct buffer *next; /* The most recently used buffer is first */
+	char *name;
+	size_t refs; /* Held by the list, and by each request using it */
+	pthread_mutex_t mutex;
+	struct makel_snapshot *snapshot;
+};
+
+struct server {
+	int fd;
+	pthread_mutex_t mutex;
+	struct result **buckets;
+	size_t nbuckets;
+	size_t nresults;
+	struct result *newest;
+	struct result *oldest;
+	struct buffer *buffers;
+	size_t nbuffers;
+};
+
+
+static int
+is_same_file(const struct result *result, const struct stat *st)
+{
+	return result->dev == st->st_dev && result->ino == st->st_ino &&
+	       result->size == st->st_size &&
+	       result->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       result->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+
+static struct result **
+find_result(struct server *server, const char *key, size_t keylen)
+{
+	struct result **resultp;
+	size_t i = (size_t)(hash_data(key, keylen, 0) % server->nbuckets);
+
+	for (resultp = &server->buckets[i]; *resultp; resultp = &(*resultp)->next)
+		if ((*resultp)->keylen == keylen && !memcmp((*resultp)->key, key, keylen))
+			break;
+	return resultp;
+}
+
+
+static void
+grow_result_table(struct server *server)
+{
+	struct result **old = server->buckets, *result, *next;
+	size_t i, n = server->nbuckets;
+
+	server->nbuckets *= 2;
+	server->buckets = ecalloc(server->nbuckets, sizeof(*server->buckets));
+	for (i = 0; i < n; i++) {
+		for (result = old[i]; result; result = next) {
+			next = result->next;
+			result->next = NULL;
+			*find_result(server, result->key, result->keylen) = result;
+		}
+	}
+	free(old);
+}
+
+
+static void
+unlink_result(struct server *server, struct result *result)
+{
+	*(result->newer ? &result->newer->older : &server->newest) = result->older;
+	*(result->older ? &result->older->newer : &server->oldest) = result->newer;
+}
+
+
+static void
+make_newest(struct server *server, struct result *result)
+{
+	result->newer = NULL;
+	result->older = server->newest;
+	*(server->newest ? &server->newest->newer : &server->oldest) = result;
+	server->newest = result;
+}
+
+
+static void
+evict_oldest_result(struct server *server)
+{
+	struct result **resultp, *result = server->oldest;
+
+	unlink_result(server, result);
+	resultp = find_result(server, result->key, result->keylen);
+	*resultp = result->next;
+	server->nresults -= 1;
+	free(result->key);
+	free(result->text);
+	free(result);
+}
+
+
+/* Returns the exit status, or -1 if there is no result */
+static int
+lookup_result(struct server *server, const char *key, size_t keylen, const struct stat *st, FILE *stream)
+{
+	struct result *result;
+	int status = -1;
+
+	pthread_mutex_lock(&server->mutex);
+	result = *find_result(server, key, keylen);
+	if (result && is_same_file(result, st)) {
+		write_output(stream, result->text, result->len);
+		status = result->status;
+		unlink_result(server, result);
+		make_newest(server, result);
+	}
+	pthread_mutex_unlock(&server->mutex);
+	return status;
+}
+
+
+static void
+store_result(struct server *server, const char *key, size_t keylen, const struct stat *st,
+             int status, const char *text, size_t len)
+{
+	struct result **resultp, *result;
+
+	pthread_mutex_lock(&server->mutex);
+	resultp = find_result(server, key, keylen);
+	result = *resultp;
+	if (result) {
+		unlink_result(server, result);
+	} else {
+		if (server->nresults == MAX_RESULTS) {
+			evict_oldest_result(server);
+		} else if (server->nresults == server->nbuckets) {
+			grow_result_table(server);
+		}
+		resultp = find_result(server, key, keylen);
+		result = *resultp = ecalloc(1, sizeof(*result));
+		result->key = ememdup(key, keylen);
+		result->keylen = keylen;
+		server->nresults += 1;
+	}
+	make_newest(server, result);
+	result->dev = st->st_dev;
+	result->ino = st->st_ino;
+	result->size = st->st_size;
+	result->mtime = st->st_mtim;
+	result->status = status;
+	free(result->text);
+	result->text = ememdup(text, len ? len : 1);
+	result->len = len;
+	pthread_mutex_unlock(&server->mutex);
+}
+
+
+/* Diagnostics are collected in memory so that their length can be sent first */
+struct response {
+	FILE *stream;
+	char *text;
+	size_t len;
+	struct output out; /* Prints to .stream */
+};
+
+
+static int
+check_path(struct server *server, struct makel *ctx, const char *key, size_t keylen, struct response *response)
+{
+	const char *name = key, *path = &key[strlen(key) + 1];
+	struct stat st;
+	int fd, status;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		print_file_error(&response->out, path, errno, "open %s O_RDONLY", path);
+		return EXIT_ERROR;
+	}
+	if (fstat(fd, &st)) {
+		print_file_error(&response->out, path, errno, "fstat %s", path);
+		close(fd);
+		return EXIT_ERROR;
+	}
+
+	status = S_ISREG(st.st_mode) ? lookup_result(server, key, keylen, &st, response->stream) : -1;
+	if (status < 0) {
+		status = lint_fd_cached(ctx, fd, name, &response->out);
+		if (status < 0) {
+			print_file_error(&response->out, name, errno, "%s", name);
+			status = EXIT_ERROR;
+		} else if (S_ISREG(st.st_mode) && !ctx->followed_includes && !ctx->graph.checked_files &&
+		           !fflush(response->stream)) {
+			/* The response only contains the diagnostics for this file, which
+			 * only depend on the file unless other files were looked at */
+			store_result(server, key, keylen, &st, status, response->text, response->len);
+		}
+	}
+
+	close(fd);
+	return status;
+}
+
+
+static int
+check_buffer(struct makel *ctx, const char *name, const char *data, size_t len, struct response *response)
+{
+	int status;
+
+	ctx->user = &response->out;
+	status = makel_lint_buffer(ctx, data, len, name);
+	end_output(&response->out);
+	if (status < 0) {
+		print_file_error(&response->out, name, errno, "%s", name);
+		status = EXIT_ERROR;
+	}
+	return status;
+}
+
+
+/* Must be called with the server's mutex locked */
+static void
+release_buffer(struct buffer *buffer)
+{
+	if (--buffer->refs)
+		return;
+	makel_snapshot_destroy(buffer->snapshot);
+	pthread_mutex_destroy(&buffer->mutex);
+	free(buffer->name);
+	free(buffer);
+}
+
+
+/* Returns the buffer's place in the list of buffers,
+ * where it is NULL if there is no such buffer */
+static struct buffer **
+find_buffer(struct server *server, const char *name)
+{
+	struct buffer **bufferp;
+
+	for (bufferp = &server->buffers; *bufferp; bufferp = &(*bufferp)->next)
+		if (!strcmp((*bufferp)->name, name))
+			break;
+	return bufferp;
+}
+
+
+/* The buffer is used until put_buffer() is called; if it is forgotten
+ * in the meantime, it is freed once it is no longer used */
+static struct buffer *
+get_buffer(struct server *server, const char *name)
+{
+	struct buffer **bufferp, *buffer;
+
+	pthread_mutex_lock(&server->mutex);
+	bufferp = find_buffer(server, name);
+	buffer = *bufferp;
+	if (buffer) {
+		*bufferp = buffer->next;
+	} else {
+		buffer = ecalloc(1, sizeof(*buffer));
+		buffer->name = ememdup(name, strlen(name) + 1);
+		buffer->refs = 1;
+		buffer->snapshot = makel_snapshot_create();
+		if (!buffer->snapshot)
+			eprintf("makel_snapshot_create:");
+		if ((errno = pthread_mutex_init(&buffer->mutex, NULL)))
+			eprintf("pthread_mutex_init:");
+		if (server->nbuffers++ == MAX_BUFFERS) {
+			/* Forget the least recently used buffer */
+			bufferp = &server->buffers;
+			while ((*bufferp)->next)
+				bufferp = &(*bufferp)->next;
+			release_buffer(*bufferp);
+			*bufferp = NULL;
+			server->nbuffers -= 1;
+		}
+	}
+	buffer->next = server->buffers;
+	server->buffers = buffer;
+	buffer->refs += 1;
+	pthread_mutex_unlock(&server->mutex);
+	return buffer;
+}
+
+
+static void
+put_buffer(struct server *server, struct buffer *buffer)
+{
+	pthread_mutex_lock(&server->mutex);
+	release_buffer(buffer);
+	pthread_mutex_unlock(&server->mutex);
+}
+
+
+/* Called when a makefile is checked in full, so that
+ * the last check of it while it was edited is forgotten */
+static void
+forget_buffer(struct server *server, const char *name)
+{
+	struct buffer **bufferp, *buffer;
+
+	pthread_mutex_lock(&server->mutex);
+	bufferp = find_buffer(server, name);
+	buffer = *bufferp;
+	if (buffer) {
+		*bufferp = buffer->next;
+		server->nbuffers -= 1;
+		release_buffer(buffer);
+	}
+	pthread_mutex_unlock(&server->mutex);
+}
+
+
+static int
+check_edited_buffer(struct server *server, struct makel *ctx, const char *name, const char *data, size_t len,
+                    const struct makel_edit *edits, size_t nedits, struct response *response)
+{
+	struct buffer *buffer = get_buffer(server, name);
+	int status;
+
+	ctx->user = &response->out;
+	pthread_mutex_lock(&buffer->mutex);
+	status = makel_relint_buffer(ctx, buffer->snapshot, data, len, name, edits, nedits);
+	pthread_mutex_unlock(&buffer->mutex);
+	put_buffer(server, buffer);
+	end_output(&response->out);
+	if (status < 0) {
+		print_file_error(&response->out, name, errno, "%s", name);
+		status = EXIT_ERROR;
+	}
+	return status;
+}
+
+
+/* Returns 0 on success, -1 on failure */
+static int
+parse_edits(const char *s, struct makel_edit **editsp, size_t *neditsp)
+{
+	struct makel_edit edit;
+	size_t size = 0;
+	char *end;
+	void *new;
+
+	*editsp = NULL;
+	*neditsp = 0;
+	for (; *s == ' '; s = end) {
+		errno = 0;
+		if (!isdigit(s[1]))
+			goto fail;
+		edit.first_line = (size_t)strtoul(&s[1], &end, 10);
+		if (*end != ',' || !isdigit(end[1]))
+			goto fail;
+		edit.old_count = (size_t)strtoul(&end[1], &end, 10);
+		if (*end != ',' || !isdigit(end[1]))
+			goto fail;
+		edit.new_count = (size_t)strtoul(&end[1], &end, 10);
+		if (errno)
+			goto fail;
+		if (*neditsp == size) {
+			size = size ? size * 2 : 8;
+			new = counted_realloc(*editsp, size * sizeof(**editsp));
+			if (!new)
+				goto fail;
+			*editsp = new;
+		}
+		(*editsp)[(*neditsp)++] = edit;
+	}
+	if (!strcmp(s, "\n"))
+		return 0;
+
+fail:
+	free(*editsp);
+	return -1;
+}
+
+
+/* Returns 0 on success, -1 if the connection shall be closed */
+static int
+serve_request(struct server *server, struct makel *ctx, int fd, FILE *in, const char *header)
+{
+	struct response response;
+	char kind, *end, *key, reply[3 * sizeof(int) + 3 * sizeof(size_t) + 3];
+	struct makel_edit *edits = NULL;
+	size_t namelen, bodylen, nedits = 0;
+	int status, ret = -1;
+
+	kind = header[0];
+	if ((kind != 'P' && kind != 'B' && kind != 'I') || header[1] != ' ' || !isdigit(header[2]))
+		return -1;
+	errno = 0;
+	namelen = (size_t)strtoul(&header[2], &end, 10);
+	if (errno || *end++ != ' ' || !isdigit(*end))
+		return -1;
+	bodylen = (size_t)strtoul(end, &end, 10);
+	if (errno || namelen > MAX_NAME_LEN || bodylen > SIZE_MAX - MAX_NAME_LEN - 2)
+		return -1;
+	if (kind == 'P' && bodylen > MAX_NAME_LEN)
+		return -1;
+	if (kind == 'I' ? parse_edits(end, &edits, &nedits) : strcmp(end, "\n"))
+		return -1;
+
+	memset(&response, 0, sizeof(response));
+
+	/* The name and the path (or makefile) are read into the same
+	 * buffer, separated by a NUL byte, which is how results are keyed */
+	key = counted_malloc(namelen + bodylen + 2);
+	if (!key) {
+		free(edits);
+		return -1;
+	}
+	if (fread(key, 1, namelen, in) != namelen)
+		goto out;
+	key[namelen] = '\0';
+	if (fread(&key[namelen + 1], 1, bodylen, in) != bodylen)
+		goto out;
+	key[namelen + 1 + bodylen] = '\0';
+	if (memchr(key, '\0', namelen) || (kind == 'P' && memchr(&key[namelen + 1], '\0', bodylen)))
+		goto out;
+
+	response.stream = open_memstream(&response.text, &response.len);
+	if (!response.stream)
+		goto out;
+	init_output(&response.out, response.stream);
+	if (kind != 'I')
+		forget_buffer(server, key);
+	if (kind == 'P')
+		status = check_path(server, ctx, key, namelen + bodylen + 1, &response);
+	else if (kind == 'B')
+		status = check_buffer(ctx, key, &key[namelen + 1], bodylen, &response);
+	else
+		status = check_edited_buffer(server, ctx, key, &key[namelen + 1], bodylen, edits, nedits, &response);
+	destroy_output(&response.out);
+	if (fclose(response.stream))
+		goto out;
+
+	sprintf(reply, "%i %zu\n", status, response.len);
+	if (!writeall(fd, reply, strlen(reply)) && !writeall(fd, response.text, response.len))
+		ret = 0;
+
+out:
+	free(response.text);
+	free(edits);
+	free(key);
+	return ret;
+}
+
+
+static void
+serve_connection(struct server *server, struct makel *ctx, int fd)
+{
+	FILE *in;
+	char *header = NULL;
+	size_t size = 0;
+
+	in = fdopen(fd, "r");
+	if (!in) {
+		close(fd);
+		return;
+	}
+	while (getline(&header, &size, in) > 0)
+		if (serve_request(server, ctx, fd, in, header))
+			break;
+	free(header);
+	fclose(in);
+}
+
+
+static void *
+worker(void *arg)
+{
+	struct server *server = arg;
+	struct makel ctx;
+	struct timespec backoff = {0, 100000000L};
+	int fd;
+
+	/* Each thread keeps its context, and thus its
+	 * buffers, between requests */
+	init_cli_context(&ctx, NULL);
+
+	for (;;) {
+		fd = accept(server->fd, NULL, NULL);
+		if (fd >= 0) {
+			serve_connection(server, &ctx, fd);
+		} else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+			/* Out of resources, which other requests will
+			 * free, so wait a while rather than exit */
+			nanosleep(&backoff, NULL);
+		} else if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO) {
+			break;
+		}
+	}
+	eprintf("accept:");
+	return NULL;
+}
+
+
+static void
+make_address(const char *socket_path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		eprintf("%s:", socket_path);
+	}
+	strcpy(addr->sun_path, socket_path);
+}
+
+
+int
+serve(const char *socket_path, size_t jobs)
+{
+	struct server server;
+	struct sockaddr_un addr;
+	pthread_t thread;
+	size_t i;
+	int fd;
+
+	make_address(socket_path, &addr);
+	server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.fd < 0)
+		eprintf("socket AF_UNIX SOCK_STREAM:");
+
+	if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		/* Remove the socket if it was left behind by a server
+		 * that is no longer running, but not if it is in use */
+		if (errno != EADDRINUSE)
+			eprintf("bind %s:", socket_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			eprintf("socket AF_UNIX SOCK_STREAM:");
+		if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)) || errno != ECONNREFUSED) {
+			errno = EADDRINUSE;
+			eprintf("bind %s:", socket_path);
+		}
+		close(fd);
+		if (unlink(socket_path))
+			eprintf("unlink %s:", socket_path);
+		if (bind(server.fd, (struct sockaddr *)&addr, sizeof(addr)))
+			eprintf("bind %s:", socket_path);
+	}
+	if (listen(server.fd, SOMAXCONN))
+		eprintf("listen %s:", socket_path);
+
+	/* Clients that disconnect early shall not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	server.nbuckets = 64;
+	server.nresults = 0;
+	server.newest = NULL;
+	server.oldest = NULL;
+	server.buffers = NULL;
+	server.nbuffers = 0;
+	server.buckets = ecalloc(server.nbuckets, sizeof(*server.buckets));
+	if ((errno = pthread_mutex_init(&server.mutex, NULL)))
+		eprintf("pthread_mutex_init:");
+
+	if (!jobs)
+		jobs = default_job_count();
+	for (i = 1; i < jobs; i++) {
+		if ((errno = pthread_create(&thread, NULL, worker, &server)))
+			eprintf("pthread_create:");
+		pthread_detach(thread);
+	}
+	worker(&server);
+	return 0;
+}
+
+
+static char *
+read_stdin(size_t *lenp)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t r;
+
+	*lenp = 0;
+	for (;;) {
+		if (*lenp == size)
+			buf = erealloc(buf, size = size ? size * 2 : 4096);
+		r = read(STDIN_FILENO, &buf[*lenp], size - *lenp);
+		if (r > 0)
+			*lenp += (size_t)r;
+		else if (!r)
+			return buf;
+		else if (errno != EINTR)
+			eprintf("read <stdin>:");
+	}
+}
+
+
+int
+lint_via_server(const char *socket_path, const char *path)
+{
+	struct sockaddr_un addr;
+	char *header = NULL, *body, *cwd = NULL, *end;
+	const char *name = path;
+	size_t size = 0, len, namelen;
+	int fd, status;
+	FILE *in;
+
+	make_address(socket_path, &addr);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		eprintf("socket AF_UNIX SOCK_STREAM:");
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		eprintf("connect %s:", socket_path);
+
+	if (!strcmp(path, "-")) {
+		/* The server cannot read our standard input */
+		name = "<stdin>";
+		body = read_stdin(&len);
+		header = emalloc(2 * 3 * sizeof(size_t) + 5);
+		sprintf(header, "B %zu %zu\n", strlen(name), len);
+	} else {
+		/* The server has its own working directory */
+		if (path[0] != '/') {
+			cwd = getcwd(NULL, 0);
+			if (!cwd)
+				eprintf("getcwd:");
+			body = emalloc(strlen(cwd) + strlen(path) + 2);
+			stpcpy(stpcpy(stpcpy(body, cwd), "/"), path);
+			free(cwd);
+		} else {
+			body = ememdup(path, strlen(path) + 1);
+		}
+		len = strlen(body);
+		header = emalloc(2 * 3 * sizeof(size_t) + 5);
+		sprintf(header, "P %zu %zu\n", strlen(name), len);
+	}
+
+	namelen = strlen(name);
+	if (writeall(fd, header, strlen(header)) || writeall(fd, name, namelen) || writeall(fd, body, len))
+		eprintf("write %s:", socket_path);
+	free(header);
+	free(body);
+	shutdown(fd, SHUT_WR);
+
+	header = NULL;
+	in = fdopen(fd, "r");
+	if (!in)
+		eprintf("fdopen:");
+	if (getline(&header, &size, in) <= 0)
+		goto bad_response;
+	errno = 0;
+	status = (int)strtol(header, &end, 10);
+	if (errno || *end++ != ' ' || status < 0 || status > EXIT_ERROR)
+		goto bad_response;
+	len = (size_t)strtoul(end, &end, 10);
+	if (errno || strcmp(end, "\n"))
+		goto bad_response;
+
+	body = emalloc(len ? len : 1);
+	if (fread(body, 1, len, in) != len)
+		goto bad_response;
+	write_output(stderr, body, len);
+	free(body);
+	free(header);
+	fclose(in);
+	return status;
+
+bad_response:
+	if (ferror(in))
+		eprintf("read %s:", socket_path);
+	printerrorf("invalid response from server at %s", socket_path);
+	return EXIT_ERROR;
+}
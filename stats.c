@@ -0,0 +1,75 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Only counted if count_allocations is set, so
+ * that the lock is not taken otherwise */
+int count_allocations = 0;
+size_t allocation_count = 0;
+static pthread_mutex_t allocation_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+count_allocation(void)
+{
+	pthread_mutex_lock(&allocation_mutex);
+	allocation_count += 1;
+	pthread_mutex_unlock(&allocation_mutex);
+}
+
+#define COUNT_ALLOCATION() (count_allocations ? count_allocation() : (void)0)
+
+
+/* Every allocation, in the library and in makel(1),
+ * is made with these, so that they can be counted */
+void *
+counted_realloc(void *ptr, size_t n)
+{
+	COUNT_ALLOCATION();
+	return realloc(ptr, n);
+}
+
+
+void *
+counted_calloc(size_t n, size_t m)
+{
+	COUNT_ALLOCATION();
+	return calloc(n, m);
+}
+
+
+void *
+counted_malloc(size_t n)
+{
+	COUNT_ALLOCATION();
+	return malloc(n);
+}
+
+
+void
+end_phase(struct stats *stats, const struct timespec *start, enum phase phase, size_t lines, size_t bytes)
+{
+	struct phase_stats *p = &stats->phases[phase];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	p->wall_ns += (uint64_t)(now.tv_sec - start->tv_sec) * UINT64_C(1000000000);
+	p->wall_ns += (uint64_t)now.tv_nsec;
+	p->wall_ns -= (uint64_t)start->tv_nsec;
+	p->calls += 1;
+	p->lines += lines;
+	p->bytes += bytes;
+}
+
+
+void
+add_stats(struct stats *to, const struct stats *from)
+{
+	size_t i;
+
+	for (i = 0; i < NUM_PHASES; i++) {
+		to->phases[i].wall_ns += from->phases[i].wall_ns;
+		to->phases[i].calls += from->phases[i].calls;
+		to->phases[i].lines += from->phases[i].lines;
+		to->phases[i].bytes += from->phases[i].bytes;
+	}
+}
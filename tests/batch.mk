@@ -0,0 +1,4 @@
+#:4:-b -j 2 "$mk" tests/comment_cont.mk
+# Batch mode, the exit status is the most serious of all files;
+# comment_cont.mk only has a comment with a line continuation
+OBJS=\
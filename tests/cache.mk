@@ -0,0 +1,5 @@
+#:4:-c "$dir"
+#:4:-c "$dir"
+# The result is cached by the first run, and read from
+# the cache by the second run, which must give the same
+OBJS=\
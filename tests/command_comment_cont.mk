@@ -0,0 +1,4 @@
+#:2:
+all:
+	echo hello # a comment \
+	echo this is not a part of the comment
@@ -0,0 +1,5 @@
+#:0:
+all:
+	echo '#' "#" \# $$# x#y $(X:#=) \
+		echo the line above has no comment
+X = 1
@@ -0,0 +1,9 @@
+#:0:
+# A macro whose name is computed can use any macro, so none
+# is reported as unused; the output must be empty, see
+# tests/computed_macro_name.out
+ARCH = x86
+x86_CFLAGS = -O2
+
+all:
+	echo $($(ARCH)_CFLAGS)
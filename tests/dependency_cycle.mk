@@ -0,0 +1,9 @@
+#:3:
+all: prog
+
+prog: prog.o
+	$(CC) -o $@ prog.o
+
+prog.o: prog.h
+prog.h: prog.o
+	touch $@
@@ -0,0 +1,9 @@
+#:4:
+all:
+	true
+
+clean:
+	true
+
+all:
+	false
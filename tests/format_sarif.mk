@@ -0,0 +1,6 @@
+#:4:-F sarif
+# Machine-readable output, with a diagnostic of each kind: a warning
+# with a tip, a warning with an info, and the number of warnings in
+# each class; the output must be the same as tests/format_sarif.out
+LONG = word word word word word word word word word word word word word word word word word word word word word word word word word word word word word word
+OBJS=\
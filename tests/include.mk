@@ -0,0 +1,8 @@
+#:4:
+# Included files are checked, relative paths are
+# relative to the directory of this makefile
+include included_eof_cont.mk
+-include does_not_exist.mk
+
+all:
+	true
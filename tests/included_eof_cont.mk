@@ -0,0 +1,4 @@
+#:4:
+# A line continuation at end of file, which is also
+# reported for include.mk, which includes this file
+OBJ =\
@@ -0,0 +1,2 @@
+#:4:
+# caf
@@ -0,0 +1,8 @@
+#:1:
+# Macro expansions use $(...), so ${...} is a style issue,
+# but not $${...} which is passed to sh(1) as ${...}
+CC = c99
+SRC = ${CC:c99=x}.c
+
+all: $(SRC)
+	$(CC) -o $@ $$(echo $(SRC)) $${HOME}
@@ -0,0 +1,5 @@
+#:3:
+.POSIX:
+# no_rule.mk exists, so only does_not_exist is reported
+all: no_rule.mk does_not_exist
+	true
@@ -0,0 +1,5 @@
+#:4:
+all:
+	true
+
+.POSIX:
@@ -0,0 +1,169 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../libmakel.h"
+
+/* Checks that makel_relint_buffer() reports the same as
+ * makel_lint_buffer() after an edit that does not touch an
+ * include line, the file it includes, or the last line,
+ * which is continued to the end of the file */
+
+static const char *included =
+	"X = 1\n"
+	"Y = 2\n"
+	"  \n"
+	"frag:\n"
+	"\ttrue\n";
+
+static const char *before =
+	"include frag.mk\n"
+	"\n"
+	"OTHER = 1\n"
+	"\n"
+	"all: $(X) frag\n"
+	"\techo $(X) $(OTHER)\n"
+	"Z = $(Y) \\\n";
+
+static const char *after =
+	"include frag.mk\n"
+	"\n"
+	"OTHER = 2  \n"
+	"\n"
+	"all: $(X) frag\n"
+	"\techo $(X) $(OTHER)\n"
+	"Z = $(Y) \\\n";
+
+static const struct makel_edit edit = {3, 1, 1};
+
+struct output {
+	char *text;
+	size_t len;
+	size_t size;
+};
+
+static char dir[] = "/tmp/makel-relint-XXXXXX";
+static char makefile[sizeof(dir) + sizeof("/Makefile")];
+static char fragment[sizeof(dir) + sizeof("/frag.mk")];
+
+
+static void
+die(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	fprintf(stderr, "tests/relint: ");
+	vfprintf(stderr, fmt, ap);
+	if (*fmt && fmt[strlen(fmt) - 1] == ':')
+		fprintf(stderr, " %s", strerror(errno));
+	fprintf(stderr, "\n");
+	va_end(ap);
+	if (*fragment)
+		unlink(fragment);
+	rmdir(dir);
+	exit(1);
+}
+
+
+static void
+append(struct output *out, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	for (;;) {
+		va_start(ap, fmt);
+		r = vsnprintf(&out->text[out->len], out->size - out->len, fmt, ap);
+		va_end(ap);
+		if (r < 0)
+			die("vsnprintf:");
+		if ((size_t)r < out->size - out->len)
+			break;
+		out->size = out->size * 2 + (size_t)r + 1;
+		out->text = realloc(out->text, out->size);
+		if (!out->text)
+			die("realloc:");
+	}
+	out->len += (size_t)r;
+}
+
+
+static void
+collect(void *user, const struct makel_diagnostic *diagnostic)
+{
+	append(user, "%i %s %i %s:%zu-%zu: %s\n", (int)diagnostic->kind, diagnostic->class_name,
+	       diagnostic->severity, diagnostic->path ? diagnostic->path : "", diagnostic->first_line,
+	       diagnostic->last_line, diagnostic->text);
+}
+
+
+static int
+lint(const char *text, struct makel_snapshot *snapshot, const struct makel_edit *edits, size_t nedits,
+     struct output *out)
+{
+	struct makel *ctx;
+	int status;
+
+	out->len = 0;
+	*out->text = '\0';
+	ctx = makel_create();
+	if (!ctx)
+		die("makel_create:");
+	makel_set_diagnostic_callback(ctx, collect, out);
+	if (snapshot)
+		status = makel_relint_buffer(ctx, snapshot, text, strlen(text), makefile, edits, nedits);
+	else
+		status = makel_lint_buffer(ctx, text, strlen(text), makefile);
+	if (status < 0)
+		die("makel_%slint_buffer:", snapshot ? "re" : "");
+	makel_destroy(ctx);
+	return status;
+}
+
+
+int
+main(void)
+{
+	struct makel_snapshot *snapshot;
+	struct output full, relint;
+	int full_status, relint_status;
+	FILE *fp;
+
+	full.size = relint.size = 1;
+	full.text = malloc(full.size);
+	relint.text = malloc(relint.size);
+	if (!full.text || !relint.text)
+		die("malloc:");
+
+	if (!mkdtemp(dir))
+		die("mkdtemp:");
+	sprintf(makefile, "%s/Makefile", dir);
+	sprintf(fragment, "%s/frag.mk", dir);
+	fp = fopen(fragment, "w");
+	if (!fp || fputs(included, fp) == EOF || fclose(fp))
+		die("%s:", fragment);
+
+	snapshot = makel_snapshot_create();
+	if (!snapshot)
+		die("makel_snapshot_create:");
+	lint(before, snapshot, NULL, 0, &relint);
+	relint_status = lint(after, snapshot, &edit, 1, &relint);
+	full_status = lint(after, NULL, NULL, 0, &full);
+	makel_snapshot_destroy(snapshot);
+
+	if (relint_status != full_status || strcmp(relint.text, full.text)) {
+		fprintf(stderr, "tests/relint: after the edit, %i and:\n%s", relint_status, relint.text);
+		die("but a full check gives %i and:\n%s", full_status, full.text);
+	}
+
+	free(full.text);
+	free(relint.text);
+	unlink(fragment);
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,5 @@
+#:4:-S "$sock"
+#:4:-S "$sock"
+# Checked by a server, the second time the result is
+# reused as the file has not changed
+OBJS=\
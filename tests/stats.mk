@@ -0,0 +1,3 @@
+#:4:-t
+# Statistics are printed with -t, without affecting the status
+OBJS=\
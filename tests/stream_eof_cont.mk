@@ -0,0 +1,3 @@
+#:4:-u
+# Continuation to end-of-file, when the file is read line by line
+OBJS=\
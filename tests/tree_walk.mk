@@ -0,0 +1,4 @@
+#:2:-r tests -g "${mk#tests/}"
+# Tree discovery, only this file matches the pattern in tests/
+#\
+ this line is a comment because of the continuation above
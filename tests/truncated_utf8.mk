@@ -0,0 +1,2 @@
+#:4:
+# This line ends with a truncated UTF-8 sequence: 
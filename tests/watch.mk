@@ -0,0 +1,4 @@
+#:4:-m "$mk"
+# Watch mode, which checks the file again when it is written,
+# and when interrupted, exits with the status of the last check
+OBJS=\
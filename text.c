@@ -3,22 +3,48 @@
 
 
 static void
-print_long_line_tip(enum warning_class class)
+print_long_line_tip(struct makel *ctx, enum warning_class class)
 {
-	printtipf(class, "you can put a <backslash> at the end of the line to continue "
-	                 "it on the next line, except in or immediately proceeding an "
-	                 "include line");
+	printtipf(ctx, class, "you can put a <backslash> at the end of the line to continue "
+	                      "it on the next line, except in or immediately proceeding an "
+	                      "include line");
 }
 
 
-struct line *
-load_text_file(int fd, const char *fname, int nest_level, size_t *nlinesp)
+static char *
+map_text_file(int fd, size_t *sizep)
 {
-	struct line *lines;
-	char *buf = NULL, *p;
+	struct stat st;
+	void *map;
+
+	/* Only regular files can be mapped, and only if we are at
+	 * the beginning of it, otherwise we have to read it. Empty
+	 * files cannot be mapped, but there is nothing to read, so
+	 * we let read_text_file(), which handles that, deal with it.
+	 */
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size)
+		return NULL;
+	if ((uintmax_t)st.st_size > SIZE_MAX || lseek(fd, 0, SEEK_CUR))
+		return NULL;
+
+	/* The mapping is private and writable so that we can make
+	 * replacements (of NUL bytes) in place without modifying
+	 * the file; only pages we write to will be copied. */
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*sizep = (size_t)st.st_size;
+	return map;
+}
+
+
+static char *
+read_text_file(int fd, size_t *sizep)
+{
+	char *buf = NULL, *new;
 	size_t size = 0;
 	size_t len = 0;
-	size_t i;
 	ssize_t r;
 
 	/* getline(3) may seem like the best way to read line by line,
@@ -30,138 +56,571 @@ load_text_file(int fd, const char *fname, int nest_level, size_t *nlinesp)
 	 * caller than created it close it.
 	 */
 
-	i = 0;
-	*nlinesp = 0;
 	for (;;) {
-		if (len == size)
-			buf = erealloc(buf, size += 2048);
+		if (len == size) {
+			if (size > SIZE_MAX / 2) {
+				errno = EFBIG;
+				goto fail;
+			}
+			size = size ? size * 2 : 4096;
+			new = counted_realloc(buf, size);
+			if (!new)
+				goto fail;
+			buf = new;
+		}
 		r = read(fd, &buf[len], size - len);
 		if (r > 0)
 			len += (size_t)r;
 		else if (!r)
 			break;
-		else if (errno == EINTR)
-			continue;
-		else
-			eprintf("read %s:", fname);
-
-		for (; i < len; i++) {
-			if (buf[i] == '\n') {
-				*nlinesp += 1;
-				buf[i] = '\0';
-			} else if (buf[i] == '\0') {
-				/* https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap03.html#tag_03_403 */
-				warnf_undefined(WC_TEXT, "%s:%zu: file contains a NUL byte, this is disallowed, because "
-				                         "input files are text files, and causes undefined behaviour",
-				                fname, *nlinesp + 1);
-				/* make(1) should probably just abort */
-				printinfof(WC_TEXT, "this implementation will replace it with a <space>");
-				buf[i] = ' ';
-			}
+		else if (errno != EINTR)
+			goto fail;
+	}
+
+	*sizep = len;
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+
+/* The arrays are resized one at a time, so if one of them
+ * cannot be resized, the others may be larger than needed,
+ * which is fine as they are freed by unload_text_file() */
+static int
+resize_line_table(struct file *file, size_t size)
+{
+	void *new;
+
+	if (size > SIZE_MAX / sizeof(*file->offsets)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (!(new = counted_realloc(file->offsets, size * sizeof(*file->offsets))))
+		return -1;
+	file->offsets = new;
+	if (!(new = counted_realloc(file->lengths, size * sizeof(*file->lengths))))
+		return -1;
+	file->lengths = new;
+	if (!(new = counted_realloc(file->flags, size * sizeof(*file->flags))))
+		return -1;
+	file->flags = new;
+	return 0;
+}
+
+
+static int
+add_line(struct file *file, size_t *sizep, size_t offset, size_t len)
+{
+	if (file->nlines == *sizep) {
+		if (*sizep > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return -1;
 		}
+		if (resize_line_table(file, *sizep ? *sizep * 2 : 64))
+			return -1;
+		*sizep = *sizep ? *sizep * 2 : 64;
 	}
 
-	if (len && buf[len - 1] != '\0') { /* LF has been converted to NUL above */
+	file->offsets[file->nlines] = offset;
+	file->lengths[file->nlines] = len;
+	file->flags[file->nlines] = 0;
+	file->nlines += 1;
+	return 0;
+}
+
+
+static void
+warn_nul_byte(struct makel *ctx, struct file *file, size_t i)
+{
+	/* https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap03.html#tag_03_403 */
+	warnf_undefined(ctx, WC_TEXT, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+	                "file contains a NUL byte, this is disallowed, because "
+	                "input files are text files, and causes undefined behaviour");
+	/* make(1) should probably just abort */
+	printinfof(ctx, WC_TEXT, "this implementation will replace it with a <space>");
+}
+
+
+static void
+warn_missing_newline(struct makel *ctx, struct file *file, size_t i)
+{
+	/* https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap03.html#tag_03_403 */
+	warnf_undefined(ctx, WC_TEXT, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+	                "is non-empty but does not end with a <newline>, which is "
+	                "required because input files are text files, and omission of it "
+	                "causes undefined behaviour");
+	/* make(1) should probably just abort */
+	printinfof(ctx, WC_TEXT, "this implementation will add the missing <newline>");
+}
+
+
+void
+check_line_length(struct makel *ctx, struct file *file, size_t i)
+{
+	if (file->lengths[i] + 1 > 2048) {
 		/* https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap03.html#tag_03_403 */
-		warnf_undefined(WC_TEXT, "%s:%zu: is non-empty but does not end with a <newline>, which is "
-		                         "required because input files are text files, and omission of it "
-		                         "causes undefined behaviour",
-		                fname, *nlinesp + 1);
-		/* make(1) should probably just abort */
-		printinfof(WC_TEXT, "this implementation will add the missing <newline>");
-		buf = erealloc(buf, len + 1);
-		buf[len++] = '\0';
-		*nlinesp += 1;
-	}
-
-	lines = *nlinesp ? ecalloc(*nlinesp, sizeof(*lines)) : NULL;
-	for (p = buf, i = 0; i < *nlinesp; i++) {
-		lines[i].lineno = i + 1;
-		lines[i].path = fname;
-		lines[i].len = strlen(p);
-		lines[i].data = ememdup(p, lines[i].len + 1);
-		lines[i].eof = i + 1 == *nlinesp;
-		lines[i].nest_level = nest_level;
-
-		if (lines[i].len + 1 > 2048) {
-			/* https://pubs.opengroup.org/onlinepubs/9699919799/basedefs/V1_chap03.html#tag_03_403 */
-			warnf_undefined(WC_TEXT, "%s:%zu: line is, including the <newline> character, longer than "
-			                         "2048 bytes which causes undefined behaviour as input files are "
-			                         "text files and POSIX only guarantees support for lines up to 2048 "
-			                         "bytes long including the <newline> character in text files",
-			                fname, *nlinesp + 1);
-			printinfof(WC_TEXT, "this implementation supports arbitrarily long lines");
-			print_long_line_tip(WC_TEXT);
+		warnf_undefined(ctx, WC_TEXT, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		                "line is, including the <newline> character, longer than "
+		                "2048 bytes which causes undefined behaviour as input files are "
+		                "text files and POSIX only guarantees support for lines up to 2048 "
+		                "bytes long including the <newline> character in text files");
+		printinfof(ctx, WC_TEXT, "this implementation supports arbitrarily long lines");
+		print_long_line_tip(ctx, WC_TEXT);
+	}
+}
+
+
+/* Splits the loaded file into lines, on failure the file is unloaded */
+static int
+split_text(struct makel *ctx, struct file *file)
+{
+	char *buf = file->data;
+	size_t len = file->size, size = 0;
+	size_t i, start;
+	int saved_errno;
+
+	/* Split the file into lines and find NUL bytes in the same
+	 * pass, so that each byte in the file is only looked at once */
+	for (i = start = 0;; i++) {
+		i += find_newline_or_nul(&buf[i], len - i);
+		if (i == len)
+			break;
+
+		if (buf[i] == '\n') {
+			if (add_line(file, &size, start, i - start))
+				goto fail;
+			start = i + 1;
+		} else {
+			warn_nul_byte(ctx, file, file->nlines);
+			buf[i] = ' ';
 		}
-		p += lines[i].len + 1;
 	}
 
-	free(buf);
-	return lines;
+	if (start < len) {
+		warn_missing_newline(ctx, file, file->nlines);
+		/* Lines are not NUL-terminated, so there is nothing to add */
+		if (add_line(file, &size, start, len - start))
+			goto fail;
+	}
+
+	if (!file->nlines)
+		return 0;
+
+	if (size > file->nlines && resize_line_table(file, file->nlines))
+		goto fail;
+	file->flags[file->nlines - 1] |= LINE_EOF;
+
+	for (i = 0; i < file->nlines; i++)
+		check_line_length(ctx, file, i);
+	return 0;
+
+fail:
+	saved_errno = errno;
+	unload_text_file(file);
+	errno = saved_errno;
+	return -1;
+}
+
+
+/* On failure, -1 is returned, errno is set, and nothing needs to be unloaded */
+int
+load_text_file(struct makel *ctx, int fd, const char *fname, int nest_level, struct file *file)
+{
+	char *buf;
+	size_t len;
+
+	memset(file, 0, sizeof(*file));
+	file->path = fname;
+	file->nest_level = nest_level;
+
+	/* Regular files are mapped into memory and the lines will
+	 * point directly into the mapping; anything else (pipes,
+	 * terminals, and so on) is read into an allocated buffer */
+	buf = map_text_file(fd, &len);
+	file->mapped = !!buf;
+	if (!buf)
+		buf = read_text_file(fd, &len);
+	if (!buf)
+		return -1;
+	file->data = buf;
+	file->size = len;
+
+	return split_text(ctx, file);
+}
+
+
+/* Like load_text_file(), but the file is already in memory; it
+ * is copied as NUL bytes are replaced in the loaded file */
+int
+load_text_buffer(struct makel *ctx, const void *data, size_t len, const char *fname, int nest_level, struct file *file)
+{
+	memset(file, 0, sizeof(*file));
+	file->path = fname;
+	file->nest_level = nest_level;
+
+	file->data = counted_malloc(len ? len : 1);
+	if (!file->data)
+		return -1;
+	memcpy(file->data, data, len);
+	file->size = len;
+
+	return split_text(ctx, file);
 }
 
 
 void
-check_utf8_encoding(struct line *line)
+unload_text_file(struct file *file)
 {
-	size_t off, r;
+	if (file->mapped)
+		munmap(file->data, file->size);
+	else
+		free(file->data);
+	free(file->extra);
+	free(file->offsets);
+	free(file->lengths);
+	free(file->flags);
+}
+
+
+void
+open_text_stream(int fd, const char *fname, int nest_level, struct text_stream *stream)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->fd = fd;
+	stream->file.path = fname;
+	stream->file.nest_level = nest_level;
+}
+
+
+/* Makes room for more data; the space used by dropped lines is
+ * reused if that frees at least half of the buffer, otherwise
+ * the buffer grows, so that each byte is only moved a constant
+ * number of times on average. Since rewritten lines are addressed
+ * by offsets starting at the end of the buffer, they are moved
+ * when the buffer grows */
+static int
+make_room_in_stream(struct text_stream *stream)
+{
+	struct file *file = &stream->file;
+	size_t i, size;
+	char *new;
+
+	if (stream->base && stream->base >= file->size / 2) {
+		memmove(file->data, &file->data[stream->base], stream->len - stream->base);
+		for (i = 0; i < file->nlines; i++)
+			if (file->offsets[i] < file->size)
+				file->offsets[i] -= stream->base;
+		stream->len -= stream->base;
+		stream->start -= stream->base;
+		stream->scanned -= stream->base;
+		stream->base = 0;
+		return 0;
+	}
+
+	if (file->size > SIZE_MAX / 2) {
+		errno = EFBIG;
+		return -1;
+	}
+	size = file->size ? file->size * 2 : 64 << 10; /* Fewer read(3) calls, and still small */
+	new = counted_realloc(file->data, size);
+	if (!new)
+		return -1;
+	for (i = 0; i < file->nlines; i++)
+		if (file->offsets[i] >= file->size)
+			file->offsets[i] += size - file->size;
+	file->data = new;
+	file->size = size;
+	return 0;
+}
+
+
+/* Adds the next line of the stream to the line table, and returns
+ * 1, or 0 at the end of the file, or -1 on failure; LINE_EOF is
+ * only set on lines that end with a <backslash>, as it is only used
+ * for them, so that other lines can be checked as soon as they have
+ * been read, rather than when the next line begins to arrive */
+int
+read_text_line(struct makel *ctx, struct text_stream *stream)
+{
+	struct file *file = &stream->file;
+	char *buf;
+	size_t i;
+	ssize_t r;
+	int ready;
+
+	for (;;) {
+		buf = file->data;
+		for (i = stream->scanned;; i++) {
+			i += find_newline_or_nul(&buf[i], stream->len - i);
+			if (i == stream->len || buf[i] == '\n')
+				break;
+			warn_nul_byte(ctx, file, file->nlines);
+			buf[i] = ' ';
+		}
+		stream->scanned = i;
+
+		if (i < stream->len) {
+			ready = i + 1 < stream->len || stream->eof ||
+			        i == stream->start || buf[i - 1] != '\\';
+		} else {
+			ready = stream->eof && stream->start < i;
+		}
+
+		if (ready) {
+			if (i == stream->len)
+				warn_missing_newline(ctx, file, file->nlines);
+			if (add_line(file, &stream->table_size, stream->start, i - stream->start))
+				return -1;
+			if (i + 1 >= stream->len && stream->eof)
+				file->flags[file->nlines - 1] |= LINE_EOF;
+			stream->start = stream->scanned = MIN(i + 1, stream->len);
+			return 1;
+		} else if (stream->eof) {
+			return 0;
+		}
+
+		if (stream->len == file->size && make_room_in_stream(stream))
+			return -1;
+		r = read(stream->fd, &file->data[stream->len], file->size - stream->len);
+		if (r > 0)
+			stream->len += (size_t)r;
+		else if (!r)
+			stream->eof = 1;
+		else if (errno != EINTR)
+			return -1;
+	}
+}
+
+
+/* Discards all lines in the line table, the line
+ * numbers of the lines that follow are unchanged */
+void
+drop_text_lines(struct text_stream *stream)
+{
+	struct file *file = &stream->file;
+
+	stream->base = stream->start;
+	file->line_offset += file->nlines;
+	file->nlines = 0;
+	file->extra_len = 0;
+}
+
+
+static char *
+reserve_extra(struct file *file, size_t n)
+{
+	size_t size = file->extra_size;
+	char *new;
+
+	if (n > SIZE_MAX / 2 - file->extra_len) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (file->extra_len + n > size) {
+		size = MAX(size * 2, file->extra_len + n);
+		new = counted_realloc(file->extra, size);
+		if (!new)
+			return NULL;
+		file->extra = new;
+		file->extra_size = size;
+	}
+	return &file->extra[file->extra_len];
+}
+
+
+/* Moves the lines that have been rewritten in a copy of the file,
+ * used to check some of the lines, into the file; the copy's line
+ * table must be a part of the file's line table */
+int
+merge_rewritten_lines(struct file *file, struct file *part)
+{
+	size_t i;
+	char *p;
+
+	if (!part->extra_len)
+		return 0;
+	p = reserve_extra(file, part->extra_len);
+	if (!p)
+		return -1;
+	memcpy(p, part->extra, part->extra_len);
+	for (i = 0; i < part->nlines; i++)
+		if (part->offsets[i] >= part->size)
+			part->offsets[i] += file->extra_len;
+	file->extra_len += part->extra_len;
+	return 0;
+}
+
+
+int
+check_utf8_encoding(struct makel *ctx, struct file *file, size_t i)
+{
+	size_t off, r, done = 0, len = 0;
+	size_t linelen = file->lengths[i];
+	const char *data = LINE_DATA(file, i);
+	char *fixed = NULL;
 	uint_least32_t codepoint;
 #if GRAPHEME_INVALID_CODEPOINT == 0xFFFD
 	unsigned char invalid_codepoint_encoding[] = {0xEF, 0xBF, 0xBD};
 #endif
 
-	for (off = 0; off < line->len; off += r) {
-		r = grapheme_decode_utf8(&line->data[off], line->len - off, &codepoint);
+	/* Invalid sequences are not replaced in place, instead the
+	 * corrected line is built in a separate buffer, so that the
+	 * time is linear in the length of the line rather than in the
+	 * product of the length and the number of invalid sequences */
+
+	for (off = 0; off < linelen; off += r) {
+		/* ASCII is always valid, so only decode from the first non-ASCII byte */
+		off += ascii_span(&data[off], linelen - off);
+		if (off == linelen)
+			break;
+
+		r = grapheme_decode_utf8(&data[off], linelen - off, &codepoint);
+		if (r > linelen - off) /* Sequence truncated by the end of the line */
+			r = linelen - off;
 
 		if (codepoint == GRAPHEME_INVALID_CODEPOINT &&
 		    (r != ELEMSOF(invalid_codepoint_encoding) ||
-		     memcmp(&line->data[off], invalid_codepoint_encoding, r))) {
-
-			warnf_unspecified(WC_ENCODING, "%s:%zu: line contains invalid UTF-8", line->path, line->lineno);
-			printinfof(WC_ENCODING, "this implementation will replace it the "
-			                        "Unicode replacement character (U+FFFD)");
-
-			line->data = erealloc(line->data, line->len - r + ELEMSOF(invalid_codepoint_encoding));
-			memmove(&line->data[off + ELEMSOF(invalid_codepoint_encoding)],
-			        &line->data[off + r],
-			        line->len - off - r);
-			memcpy(&line->data[off], invalid_codepoint_encoding, ELEMSOF(invalid_codepoint_encoding));
-			line->len -= r;
-			line->len += r = ELEMSOF(invalid_codepoint_encoding);
+		     memcmp(&data[off], invalid_codepoint_encoding, r))) {
+
+			if (!fixed) {
+				/* test cases: invalid_utf8.mk, truncated_utf8.mk, latin1_long_line.gen */
+				warnf_unspecified(ctx, WC_ENCODING, file->path,
+				                  LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+				                  "line contains invalid UTF-8");
+				printinfof(ctx, WC_ENCODING, "this implementation will replace it the "
+				                             "Unicode replacement character (U+FFFD)");
+
+				/* No byte can grow longer than the replacement character */
+				if (linelen - off > (SIZE_MAX - off) / ELEMSOF(invalid_codepoint_encoding)) {
+					errno = ENOMEM;
+					return -1;
+				}
+				fixed = reserve_extra(file, off + (linelen - off) * ELEMSOF(invalid_codepoint_encoding));
+				if (!fixed)
+					return -1;
+				data = LINE_DATA(file, i); /* In case it was rewritten before and has been moved */
+			}
+
+			memcpy(&fixed[len], &data[done], off - done);
+			len += off - done;
+			memcpy(&fixed[len], invalid_codepoint_encoding, ELEMSOF(invalid_codepoint_encoding));
+			len += ELEMSOF(invalid_codepoint_encoding);
+			done = off + r;
 		}
 	}
+
+	if (fixed) {
+		memcpy(&fixed[len], &data[done], linelen - done);
+		len += linelen - done;
+		file->offsets[i] = file->size + file->extra_len;
+		file->lengths[i] = len;
+		file->extra_len += len;
+	}
+	return 0;
 }
 
 
 void
-check_column_count(struct line *line)
+check_column_count(struct makel *ctx, struct file *file, size_t i)
 {
 	size_t columns = 0;
 	size_t off, r;
+	size_t len = file->lengths[i];
+	const char *data = LINE_DATA(file, i);
 	uint_least32_t codepoint;
 
-	if (line->len <= style.max_line_length) /* Column count cannot be more than byte count */
+	if (len <= ctx->style.max_line_length) /* Column count cannot be more than byte count */
 		return;
 
-	for (off = 0; off < line->len; off += r) {
-		r = grapheme_decode_utf8(&line->data[off], line->len - off, &codepoint);
+	for (off = 0; off < len; off += r) {
+		/* wcwidth(3) returns 1 for printable ASCII characters and
+		 * -1 for control characters, which we count as 1 column;
+		 * there are no NUL bytes left as they have been replaced,
+		 * so for ASCII text, the column count is the byte count */
+		r = ascii_span(&data[off], len - off);
+		columns += r;
+		off += r;
+		if (off == len)
+			break;
+
+		r = grapheme_decode_utf8(&data[off], len - off, &codepoint);
 		columns += (size_t)abs(wcwidth((wchar_t)codepoint));
 	}
 
-	if (columns > style.max_line_length) {
-		warnf_style(WC_LONG_LINE, "%s:%zu: line is longer than %zu columns",
-		            line->path, line->lineno, columns);
-		if (line->len + 1 <= 2048)
-			print_long_line_tip(WC_LONG_LINE);
+	if (columns > ctx->style.max_line_length) {
+		warnf_style(ctx, WC_LONG_LINE, file->path, LINE_NUMBER(file, i), LINE_NUMBER(file, i),
+		            "line is longer than %zu columns", columns);
+		if (len + 1 <= 2048)
+			print_long_line_tip(ctx, WC_LONG_LINE);
 	}
 }
 
 
 int
-is_line_blank(struct line *line)
+is_line_blank(struct file *file, size_t i)
+{
+	const char *data = LINE_DATA(file, i);
+	size_t off = 0;
+	while (off < file->lengths[i] && isspace(data[off]))
+		off++;
+	return off == file->lengths[i];
+}
+
+
+void
+open_logical_line(struct logical_line *line, const struct file *file, size_t i)
 {
-	char *s = line->data;
-	while (isspace(*s))
-		s++;
-	return !*s;
+	line->file = file;
+	line->first = line->next = i;
+	line->at_joiner = 0;
+	line->done = 0;
+}
+
+
+/* Returns 0 when there are no more spans; a continued line is
+ * joined with <backslash> <newline> if it is a command line, and
+ * the first <tab> of the next line is removed, otherwise it is
+ * joined with a <space>, and the next line's leading white space
+ * is removed; the <backslash> is never included in the spans */
+int
+next_span(struct logical_line *line, struct span *span)
+{
+	const struct file *file = line->file;
+	size_t i = line->next;
+	const char *s;
+	size_t len;
+	int cmd;
+
+	if (line->done)
+		return 0;
+
+	cmd = i != line->first && (file->flags[i - 1] & LINE_CMD_JOINER);
+	if (line->at_joiner) {
+		span->s = cmd ? "\\\n" : " ";
+		span->len = cmd ? 2 : 1;
+		span->line = i - 1;
+		line->at_joiner = 0;
+		return 1;
+	}
+
+	s = LINE_DATA(file, i);
+	len = file->lengths[i];
+	if (cmd) {
+		if (len && *s == '\t')
+			s++, len--;
+	} else if (i != line->first) {
+		while (len && isblank(*s))
+			s++, len--;
+	}
+	span->s = s;
+	span->len = len;
+	span->line = i;
+
+	line->next = i + 1;
+	line->at_joiner = !!(file->flags[i] & LINE_CONTINUED);
+	line->done = !line->at_joiner;
+	return 1;
 }
@@ -2,50 +2,249 @@
 #include "common.h"
 
 
-struct warning_class_data warning_classes[] = {
-#define X(ENUM, NAME, ACTION) {NAME, ACTION},
-	LIST_WARNING_CLASSES(X)
-#undef X
-	{NULL, 0}
+enum output_format output_format = FORMAT_TEXT;
+size_t max_warnings = DEFAULT_MAX_WARNINGS;
+int collect_stats = 0;
+
+static struct stats total_stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec start_time;
+
+static const char *const phase_names[] = {
+	[PHASE_LOAD]          = "load",
+	[PHASE_ENCODING]      = "encoding",
+	[PHASE_COLUMNS]       = "columns",
+	[PHASE_CONTINUATIONS] = "continuations",
+	[PHASE_CLASSIFY]      = "classify",
+	[PHASE_MACROS]        = "macros",
+	[PHASE_RULES]         = "rules"
 };
 
 
+void
+init_cli_context(struct makel *ctx, struct output *out)
+{
+	init_context(ctx);
+	ctx->callback = print_diagnostic;
+	ctx->user = out;
+	ctx->max_warnings = max_warnings;
+	if (collect_stats)
+		ctx->stats = ecalloc(1, sizeof(*ctx->stats));
+}
+
+
+/* The statistics collected with the context are added to the totals */
+void
+destroy_cli_context(struct makel *ctx)
+{
+	if (ctx->stats) {
+		pthread_mutex_lock(&stats_mutex);
+		add_stats(&total_stats, ctx->stats);
+		pthread_mutex_unlock(&stats_mutex);
+		free(ctx->stats);
+		ctx->stats = NULL;
+	}
+	destroy_context(ctx);
+}
+
+
+void
+init_output(struct output *out, FILE *stream)
+{
+	memset(out, 0, sizeof(*out));
+	out->stream = stream;
+}
+
+
+/* Prints the diagnostic that is kept until it is known
+ * that no more notes will be attached to it, if any */
+void
+end_output(struct output *out)
+{
+	if (output_format != FORMAT_TEXT)
+		end_machine_record(out);
+}
+
+
+void
+destroy_output(struct output *out)
+{
+	end_output(out);
+	free(out->record);
+}
+
+
+/* Output to stderr is collected here and written in batches,
+ * as there can be hundreds of thousands of diagnostics; text is
+ * only added whole, or cut at a <newline>, so a batch never ends
+ * inside a diagnostic, and if stderr is a pipe, a batch is no
+ * larger than PIPE_BUF so that each write(3) is atomic, keeping
+ * diagnostics from being mixed with output from other processes */
+static pthread_mutex_t output_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char output_buf[64 << 10];
+static size_t output_len = 0;
+static size_t output_limit = 0;
+static int sarif_results = 0;
+
+
 static void
-vxprintwarningf(enum warning_class class, int severity, const char *fmt, va_list ap)
-{
-	if (warning_classes[class].action != IGNORE) {
-		fprintf(stderr, "[%s] ",
-		        warning_classes[class].action == INFORM ? "info" :
-		        warning_classes[class].action == WARN_STYLE ? "style" : "warning");
-		vfprintf(stderr, fmt, ap);
-		fprintf(stderr, " (-w%s)\n", warning_classes[class].name);
-		if (warning_classes[class].action != INFORM)
-			exit_status = MAX(exit_status, severity);
+flush_output_locked(void)
+{
+	/* Nothing can be done if stderr fails */
+	if (output_len)
+		writeall(STDERR_FILENO, output_buf, output_len);
+	output_len = 0;
+}
+
+
+void
+flush_output(void)
+{
+	pthread_mutex_lock(&output_mutex);
+	flush_output_locked();
+	pthread_mutex_unlock(&output_mutex);
+}
+
+
+static void
+write_stderr(const char *text, size_t len)
+{
+	struct stat st;
+	size_t n;
+
+	pthread_mutex_lock(&output_mutex);
+	if (!output_limit) {
+		output_limit = sizeof(output_buf);
+		if (!fstat(STDERR_FILENO, &st) && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+			output_limit = MIN(output_limit, PIPE_BUF);
+	}
+
+	/* Each SARIF result is preceded by a comma, except the first */
+	if (output_format == FORMAT_SARIF && !sarif_results && len && *text == ',') {
+		sarif_results = 1;
+		text++;
+		len--;
+	}
+
+	while (len) {
+		if (len > output_limit - output_len)
+			flush_output_locked();
+		n = len;
+		if (n > output_limit) {
+			/* Cut after the last <newline> that fits, or if
+			 * there is none, write the line as it is */
+			for (n = output_limit; n && text[n - 1] != '\n'; n--);
+			if (!n) {
+				for (n = output_limit; n < len && text[n - 1] != '\n'; n++);
+				writeall(STDERR_FILENO, text, n);
+				text += n;
+				len -= n;
+				continue;
+			}
+		}
+		memcpy(&output_buf[output_len], text, n);
+		output_len += n;
+		text += n;
+		len -= n;
 	}
+	pthread_mutex_unlock(&output_mutex);
 }
 
 
+/* Prints text made up of complete diagnostics, or
+ * other complete lines, to any stream */
 void
-xprintwarningf(enum warning_class class, int severity, const char *fmt, ...)
+write_output(FILE *stream, const char *text, size_t len)
 {
-	va_list ap;
-	va_start(ap, fmt);
-	vxprintwarningf(class, severity, fmt, ap);
-	va_end(ap);
+	if (stream == stderr)
+		write_stderr(text, len);
+	else
+		fwrite(text, 1, len, stream);
+}
+
+
+static int
+format_diagnostic(char *buf, size_t size, const struct makel_diagnostic *diagnostic)
+{
+	const char *prefix;
+
+	if (diagnostic->kind == MAKEL_INFO || diagnostic->kind == MAKEL_COUNT)
+		return snprintf(buf, size, "[info] %s\n", diagnostic->text);
+	else if (diagnostic->kind == MAKEL_TIP)
+		return snprintf(buf, size, "[tip] %s\n", diagnostic->text);
+
+	prefix = diagnostic->action == MAKEL_INFORM ? "info" :
+	         diagnostic->action == MAKEL_WARN_STYLE ? "style" : "warning";
+	if (!diagnostic->path)
+		return snprintf(buf, size, "[%s] %s (-w%s)\n", prefix,
+		                diagnostic->text, diagnostic->class_name);
+	else if (!diagnostic->first_line)
+		return snprintf(buf, size, "[%s] %s: %s (-w%s)\n", prefix, diagnostic->path,
+		                diagnostic->text, diagnostic->class_name);
+	else if (diagnostic->first_line == diagnostic->last_line)
+		return snprintf(buf, size, "[%s] %s:%zu: %s (-w%s)\n", prefix, diagnostic->path,
+		                diagnostic->first_line, diagnostic->text, diagnostic->class_name);
+	else
+		return snprintf(buf, size, "[%s] %s:%zu,%zu: %s (-w%s)\n", prefix, diagnostic->path,
+		                diagnostic->first_line, diagnostic->last_line,
+		                diagnostic->text, diagnostic->class_name);
 }
 
 
+/* Each diagnostic is formatted as a whole, so that it
+ * is written at once, and then discarded */
 void
-printinfof(enum warning_class class, const char *fmt, ...)
+print_diagnostic(void *user, const struct makel_diagnostic *diagnostic)
 {
-	va_list ap;
-	if (warning_classes[class].action != IGNORE) {
-		va_start(ap, fmt);
-		fprintf(stderr, "[info] ");
-		vfprintf(stderr, fmt, ap);
-		fprintf(stderr, "\n");
-		va_end(ap);
+	struct output *out = user;
+	char small[512], *buf = small;
+	int len;
+
+	if (output_format != FORMAT_TEXT) {
+		print_machine_diagnostic(out, diagnostic);
+		return;
 	}
+
+	len = format_diagnostic(small, sizeof(small), diagnostic);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(small)) {
+		buf = emalloc((size_t)len + 1);
+		format_diagnostic(buf, (size_t)len + 1, diagnostic);
+	}
+	write_output(out->stream, buf, (size_t)len);
+	if (buf != small)
+		free(buf);
+}
+
+
+/* For errors that only affect one file, so that other files are
+ * still checked, and that are printed with the file's diagnostics */
+void
+print_file_error(struct output *out, const char *path, int err, const char *fmt, ...)
+{
+	va_list ap;
+	char *message = NULL;
+	size_t len = 0;
+	FILE *fp;
+
+	fp = open_memstream(&message, &len);
+	if (!fp)
+		eprintf("open_memstream:");
+	if (output_format == FORMAT_TEXT)
+		fprintf(fp, "%s: ", argv0);
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	fprintf(fp, output_format == FORMAT_TEXT ? ": %s\n" : ": %s", strerror(err));
+	if (fclose(fp))
+		eprintf("fclose <memory stream>:");
+
+	if (output_format == FORMAT_TEXT)
+		write_output(out->stream, message, len);
+	else
+		print_machine_error(out, path, message);
+	free(message);
 }
 
 
@@ -53,6 +252,7 @@ void
 printerrorf(const char *fmt, ...)
 {
 	va_list ap;
+	flush_output();
 	va_start(ap, fmt);
 	fprintf(stderr, "%s: [error] ", argv0);
 	vfprintf(stderr, fmt, ap);
@@ -63,14 +263,81 @@ printerrorf(const char *fmt, ...)
 
 
 void
-printtipf(enum warning_class class, const char *fmt, ...)
+start_stats(void)
 {
-	va_list ap;
-	if (warning_classes[class].action != IGNORE) {
-		va_start(ap, fmt);
-		fprintf(stderr, "[tip] ");
-		vfprintf(stderr, fmt, ap);
-		fprintf(stderr, "\n");
-		va_end(ap);
+	collect_stats = 1;
+	count_allocations = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+
+static double
+to_ms(uint64_t ns)
+{
+	return (double)ns / 1000000.;
+}
+
+
+static uint64_t
+timeval_to_ns(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * UINT64_C(1000000000) + (uint64_t)tv->tv_usec * 1000;
+}
+
+
+/* Printed at exit, after all diagnostics; the totals for the
+ * process, rather than for the files, include the time spent
+ * reading the cache and waiting for output */
+void
+print_stats(void)
+{
+	const struct phase_stats *p;
+	struct timespec now;
+	struct rusage usage;
+	uint64_t wall_ns, user_ns, system_ns;
+	char *text = NULL;
+	size_t i, len = 0;
+	FILE *fp;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wall_ns = (uint64_t)(now.tv_sec - start_time.tv_sec) * UINT64_C(1000000000);
+	wall_ns = wall_ns + (uint64_t)now.tv_nsec - (uint64_t)start_time.tv_nsec;
+	if (getrusage(RUSAGE_SELF, &usage))
+		memset(&usage, 0, sizeof(usage));
+	user_ns = timeval_to_ns(&usage.ru_utime);
+	system_ns = timeval_to_ns(&usage.ru_stime);
+
+	fp = open_memstream(&text, &len);
+	if (!fp)
+		eprintf("open_memstream:");
+	pthread_mutex_lock(&stats_mutex);
+	if (output_format == FORMAT_TEXT) {
+		fprintf(fp, "[stats] %-13s %10s %12s %14s %12s\n", "phase", "calls", "lines", "bytes", "wall ms");
+		for (i = 0; i < NUM_PHASES; i++) {
+			p = &total_stats.phases[i];
+			fprintf(fp, "[stats] %-13s %10zu %12zu %14zu %12.3f\n",
+			        phase_names[i], p->calls, p->lines, p->bytes, to_ms(p->wall_ns));
+		}
+		fprintf(fp, "[stats] wall %.3f ms, user %.3f ms, system %.3f ms\n",
+		        to_ms(wall_ns), to_ms(user_ns), to_ms(system_ns));
+		fprintf(fp, "[stats] peak RSS %li KiB, %zu allocations\n", (long int)usage.ru_maxrss, allocation_count);
+	} else {
+		fprintf(fp, "{\"kind\":\"stats\",\"wall_ns\":%llu,\"user_ns\":%llu,\"system_ns\":%llu,"
+		            "\"peak_rss_kib\":%li,\"allocations\":%zu,\"phases\":{",
+		        (unsigned long long int)wall_ns, (unsigned long long int)user_ns,
+		        (unsigned long long int)system_ns, (long int)usage.ru_maxrss, allocation_count);
+		for (i = 0; i < NUM_PHASES; i++) {
+			p = &total_stats.phases[i];
+			fprintf(fp, "%s\"%s\":{\"calls\":%zu,\"lines\":%zu,\"bytes\":%zu,\"wall_ns\":%llu}",
+			        i ? "," : "", phase_names[i], p->calls, p->lines, p->bytes,
+			        (unsigned long long int)p->wall_ns);
+		}
+		fprintf(fp, "}}\n");
 	}
+	pthread_mutex_unlock(&stats_mutex);
+	if (fclose(fp))
+		eprintf("fclose <memory stream>:");
+
+	write_output(stderr, text, len);
+	free(text);
 }
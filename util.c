@@ -5,7 +5,7 @@
 void *
 erealloc(void *ptr, size_t n)
 {
-	void *ret = realloc(ptr, n);
+	void *ret = counted_realloc(ptr, n);
 	if (!ret)
 		eprintf("realloc %zu:", n);
 	return ret;
@@ -15,7 +15,7 @@ erealloc(void *ptr, size_t n)
 void *
 ecalloc(size_t n, size_t m)
 {
-	void *ret = calloc(n, m);
+	void *ret = counted_calloc(n, m);
 	if (!ret)
 		eprintf("calloc %zu %zu:", n, m);
 	return ret;
@@ -25,7 +25,7 @@ ecalloc(size_t n, size_t m)
 void *
 emalloc(size_t n)
 {
-	void *ret = malloc(n);
+	void *ret = counted_malloc(n);
 	if (!ret)
 		eprintf("malloc %zu:", n);
 	return ret;
@@ -41,12 +41,34 @@ ememdup(const void *ptr, size_t n)
 }
 
 
+/* Returns 0 on success, -1 on failure */
+int
+writeall(int fd, const void *data, size_t n)
+{
+	const char *s = data;
+	ssize_t r;
+
+	while (n) {
+		r = write(fd, s, n);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		s += r;
+		n -= (size_t)r;
+	}
+	return 0;
+}
+
+
 void
 eprintf(const char *fmt, ...)
 {
 	va_list ap;
 	int err = errno;
 	char end = *fmt ? strchr(fmt, '\0')[-1] : '\0';
+	flush_output();
 	va_start(ap, fmt);
 	fprintf(stderr, "%s: ", argv0);
 	vfprintf(stderr, fmt, ap);
@@ -0,0 +1,300 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* Directories are scanned and files are checked by the
+ * same threads: each thread has its own double-ended task
+ * queue, it takes tasks from the end it adds tasks to, and
+ * when it runs out of tasks, it steals from the other end
+ * of another thread's queue. This way a thread that is stuck
+ * on a very large file will not keep the directories it has
+ * found to itself. */
+
+struct task {
+	char *path;
+	int is_dir;
+};
+
+struct deque {
+	pthread_mutex_t mutex;
+	struct task *tasks;
+	size_t head; /* Where tasks are stolen */
+	size_t tail; /* Where the owner adds and takes tasks */
+	size_t size;
+};
+
+struct walk {
+	struct deque *deques;
+	size_t nworkers;
+	const char *const *patterns;
+	size_t npatterns;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t queued; /* Tasks that have not been taken */
+	size_t pending; /* Tasks that have not been completed */
+	size_t nidle;
+
+	pthread_mutex_t output_mutex;
+	int status;
+};
+
+struct worker {
+	struct walk *walk;
+	size_t index;
+	pthread_t thread;
+};
+
+
+static void
+push_task(struct walk *walk, size_t self, char *path, int is_dir)
+{
+	struct deque *deque = &walk->deques[self];
+
+	/* The task is counted before it is added, otherwise
+	 * it could be completed before it has been counted */
+	pthread_mutex_lock(&walk->mutex);
+	walk->queued += 1;
+	walk->pending += 1;
+	if (walk->nidle)
+		pthread_cond_signal(&walk->cond);
+	pthread_mutex_unlock(&walk->mutex);
+
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->tail == deque->size) {
+		if (deque->head) {
+			memmove(deque->tasks, &deque->tasks[deque->head],
+			        (deque->tail - deque->head) * sizeof(*deque->tasks));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			deque->size = deque->size ? deque->size * 2 : 64;
+			deque->tasks = erealloc(deque->tasks, deque->size * sizeof(*deque->tasks));
+		}
+	}
+	deque->tasks[deque->tail].path = path;
+	deque->tasks[deque->tail].is_dir = is_dir;
+	deque->tail += 1;
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+
+static int
+take_task(struct walk *walk, size_t self, struct task *taskp)
+{
+	struct deque *deque;
+	size_t i;
+	int found = 0;
+
+	for (i = 0; i < walk->nworkers && !found; i++) {
+		deque = &walk->deques[(self + i) % walk->nworkers];
+		pthread_mutex_lock(&deque->mutex);
+		if (deque->head != deque->tail) {
+			found = 1;
+			if (!i)
+				*taskp = deque->tasks[--deque->tail];
+			else
+				*taskp = deque->tasks[deque->head++];
+			if (deque->head == deque->tail)
+				deque->head = deque->tail = 0;
+		}
+		pthread_mutex_unlock(&deque->mutex);
+	}
+
+	if (found) {
+		pthread_mutex_lock(&walk->mutex);
+		walk->queued -= 1;
+		pthread_mutex_unlock(&walk->mutex);
+	}
+	return found;
+}
+
+
+static int
+is_makefile_name(struct walk *walk, const char *name)
+{
+	size_t i;
+	if (is_default_makefile_name(name))
+		return 1;
+	for (i = 0; i < walk->npatterns; i++)
+		if (!fnmatch(walk->patterns[i], name, 0))
+			return 1;
+	return 0;
+}
+
+
+static void
+report(struct walk *walk, const char *text, size_t len, int status)
+{
+	pthread_mutex_lock(&walk->output_mutex);
+	write_output(stderr, text, len);
+	walk->status = MAX(walk->status, status);
+	pthread_mutex_unlock(&walk->output_mutex);
+}
+
+
+static void
+report_error(struct walk *walk, const char *func, const char *path, int err)
+{
+	struct output out;
+
+	pthread_mutex_lock(&walk->output_mutex);
+	init_output(&out, stderr);
+	print_file_error(&out, path, err, "%s %s", func, path);
+	destroy_output(&out);
+	walk->status = MAX(walk->status, EXIT_ERROR);
+	pthread_mutex_unlock(&walk->output_mutex);
+}
+
+
+/* Returns 1 for directories, 0 for regular files, and -1 for anything
+ * else; symbolic links to directories are not followed as they could
+ * form loops, but symbolic links to regular files are */
+static int
+get_entry_type(const char *path, const struct dirent *f)
+{
+	struct stat st;
+
+#ifdef DT_DIR
+	if (f->d_type == DT_DIR)
+		return 1;
+	if (f->d_type == DT_REG)
+		return 0;
+#endif
+	if (lstat(path, &st))
+		return -1;
+	if (S_ISDIR(st.st_mode))
+		return 1;
+	if (!stat(path, &st) && S_ISREG(st.st_mode))
+		return 0;
+	return -1;
+}
+
+
+static void
+scan_directory(struct walk *walk, size_t self, const char *path)
+{
+	struct dirent *f;
+	char *subpath;
+	int type;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		report_error(walk, "opendir", path, errno);
+		return;
+	}
+
+	while ((errno = 0, f = readdir(dir))) {
+		if (!strcmp(f->d_name, ".") || !strcmp(f->d_name, ".."))
+			continue;
+
+		subpath = emalloc(strlen(path) + strlen(f->d_name) + 2);
+		stpcpy(stpcpy(stpcpy(subpath, path), "/"), f->d_name);
+
+		type = get_entry_type(subpath, f);
+		if (type == 1 || (type == 0 && is_makefile_name(walk, f->d_name)))
+			push_task(walk, self, subpath, type);
+		else
+			free(subpath);
+	}
+	if (errno)
+		report_error(walk, "readdir", path, errno);
+
+	closedir(dir);
+}
+
+
+static void *
+worker(void *arg)
+{
+	struct worker *self = arg;
+	struct walk *walk = self->walk;
+	struct task task;
+	char *text;
+	size_t len;
+	int status, done;
+
+	for (;;) {
+		if (take_task(walk, self->index, &task)) {
+			if (task.is_dir) {
+				scan_directory(walk, self->index, task.path);
+			} else {
+				status = lint_path_buffered(task.path, &text, &len);
+				report(walk, text, len, status);
+				free(text);
+			}
+			free(task.path);
+
+			pthread_mutex_lock(&walk->mutex);
+			if (!--walk->pending)
+				pthread_cond_broadcast(&walk->cond);
+			pthread_mutex_unlock(&walk->mutex);
+			continue;
+		}
+
+		pthread_mutex_lock(&walk->mutex);
+		while (!walk->queued && walk->pending) {
+			walk->nidle += 1;
+			pthread_cond_wait(&walk->cond, &walk->mutex);
+			walk->nidle -= 1;
+		}
+		done = !walk->pending;
+		pthread_mutex_unlock(&walk->mutex);
+		if (done)
+			return NULL;
+	}
+}
+
+
+int
+lint_trees(const char *const *dirs, size_t ndirs, const char *const *files, size_t nfiles,
+           const char *const *patterns, size_t npatterns, size_t jobs)
+{
+	struct walk walk;
+	struct worker *workers;
+	size_t i;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.nworkers = jobs ? jobs : default_job_count();
+	walk.patterns = patterns;
+	walk.npatterns = npatterns;
+	if ((errno = pthread_mutex_init(&walk.mutex, NULL)) ||
+	    (errno = pthread_mutex_init(&walk.output_mutex, NULL)))
+		eprintf("pthread_mutex_init:");
+	if ((errno = pthread_cond_init(&walk.cond, NULL)))
+		eprintf("pthread_cond_init:");
+
+	walk.deques = ecalloc(walk.nworkers, sizeof(*walk.deques));
+	for (i = 0; i < walk.nworkers; i++)
+		if ((errno = pthread_mutex_init(&walk.deques[i].mutex, NULL)))
+			eprintf("pthread_mutex_init:");
+
+	/* Initial tasks are spread over the threads, unlike
+	 * tasks found later, which are stolen when needed */
+	for (i = 0; i < ndirs; i++)
+		push_task(&walk, i % walk.nworkers, ememdup(dirs[i], strlen(dirs[i]) + 1), 1);
+	for (i = 0; i < nfiles; i++)
+		push_task(&walk, (ndirs + i) % walk.nworkers, ememdup(files[i], strlen(files[i]) + 1), 0);
+
+	workers = ecalloc(walk.nworkers, sizeof(*workers));
+	for (i = 0; i < walk.nworkers; i++) {
+		workers[i].walk = &walk;
+		workers[i].index = i;
+		if ((errno = pthread_create(&workers[i].thread, NULL, worker, &workers[i])))
+			eprintf("pthread_create:");
+	}
+	for (i = 0; i < walk.nworkers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < walk.nworkers; i++) {
+		pthread_mutex_destroy(&walk.deques[i].mutex);
+		free(walk.deques[i].tasks);
+	}
+	free(walk.deques);
+	free(workers);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.output_mutex);
+	pthread_mutex_destroy(&walk.mutex);
+	return walk.status;
+}
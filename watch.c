@@ -0,0 +1,186 @@
+/* See LICENSE file for copyright and license details. */
+#include "common.h"
+
+
+/* How long to wait for more changes before the changed
+ * files are checked, editors and generators often write
+ * files in several steps, or write several files at once */
+#define DEBOUNCE_MS 100
+
+
+#if defined(__linux__)
+
+struct watched {
+	const char *path;
+	const char *name; /* Last component of .path */
+	int wd; /* Watch descriptor for the directory */
+	int changed;
+};
+
+
+static void
+add_watch(int fd, struct watched *file)
+{
+	char *dir, *slash;
+
+	/* The directory rather than the file is watched, because
+	 * editors often replace files rather than writing to them */
+	slash = strrchr(file->path, '/');
+	if (slash) {
+		dir = ememdup(file->path, (size_t)(slash - file->path) + 1);
+		dir[slash == file->path ? 1 : slash - file->path] = '\0';
+		file->name = &slash[1];
+	} else {
+		dir = ememdup(".", 2);
+		file->name = file->path;
+	}
+
+	file->wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (file->wd < 0)
+		eprintf("inotify_add_watch %s:", dir);
+	free(dir);
+}
+
+
+/* Returns the number of files that have been marked as changed */
+static size_t
+read_events(int fd, struct watched *files, size_t nfiles)
+{
+	union {
+		struct inotify_event event; /* For alignment */
+		char buf[4096]; /* Large enough for any event */
+	} u;
+	const struct inotify_event *event;
+	size_t i, n = 0;
+	ssize_t r, off;
+
+	r = read(fd, u.buf, sizeof(u.buf));
+	if (r < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		eprintf("read <inotify>:");
+	}
+
+	for (off = 0; off < r; off += (ssize_t)(sizeof(*event) + event->len)) {
+		event = (const void *)&u.buf[off];
+		for (i = 0; i < nfiles; i++) {
+			if (files[i].changed)
+				continue;
+			/* If events were lost, we do not know what changed */
+			if ((event->mask & IN_Q_OVERFLOW) ||
+			    (event->wd == files[i].wd && event->len && !strcmp(event->name, files[i].name))) {
+				files[i].changed = 1;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+
+/* Files are watched until makel is interrupted (SIGINT or SIGTERM),
+ * the exit status is then the most serious of the files' last checks */
+int
+watch_files(const char *const *paths, size_t npaths, size_t jobs)
+{
+	struct watched *files;
+	struct pollfd pfds[2];
+	const char **changed;
+	sigset_t signals;
+	size_t i, n, *indices;
+	int fd, r, status, *statuses, *changed_statuses;
+
+	/* The signals are read from a file descriptor, rather than
+	 * handled, so that they cannot be delivered to another thread;
+	 * they are blocked before any thread is created, as threads
+	 * inherit the signal mask */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if ((errno = pthread_sigmask(SIG_BLOCK, &signals, NULL)))
+		eprintf("pthread_sigmask:");
+	pfds[1].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	if (pfds[1].fd < 0)
+		eprintf("signalfd:");
+	pfds[1].events = POLLIN;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		eprintf("inotify_init1:");
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+
+	files = ecalloc(npaths, sizeof(*files));
+	changed = ecalloc(npaths, sizeof(*changed));
+	indices = ecalloc(npaths, sizeof(*indices));
+	statuses = ecalloc(npaths, sizeof(*statuses));
+	changed_statuses = ecalloc(npaths, sizeof(*changed_statuses));
+	for (i = 0; i < npaths; i++) {
+		files[i].path = paths[i];
+		add_watch(fd, &files[i]);
+	}
+
+	/* Files are watched before they are checked the first time,
+	 * so that changes made while they are checked are not lost */
+	lint_batch(paths, npaths, jobs, statuses);
+	flush_output();
+
+	for (;;) {
+		n = 0;
+		while (!n) {
+			if (poll(pfds, 2, -1) < 0 && errno != EINTR)
+				eprintf("poll:");
+			if (pfds[1].revents)
+				goto interrupted;
+			n += read_events(fd, files, npaths);
+		}
+		while ((r = poll(pfds, 2, DEBOUNCE_MS))) {
+			if (r < 0 && errno != EINTR)
+				eprintf("poll:");
+			else if (r > 0 && pfds[1].revents)
+				goto interrupted;
+			else if (r > 0)
+				n += read_events(fd, files, npaths);
+		}
+
+		/* Only changed files are checked again, in the order they were specified */
+		for (i = n = 0; i < npaths; i++) {
+			if (files[i].changed) {
+				files[i].changed = 0;
+				indices[n] = i;
+				changed[n++] = files[i].path;
+			}
+		}
+		lint_batch(changed, n, jobs, changed_statuses);
+		flush_output();
+		for (i = 0; i < n; i++)
+			statuses[indices[i]] = changed_statuses[i];
+	}
+
+interrupted:
+	for (i = status = 0; i < npaths; i++)
+		status = MAX(status, statuses[i]);
+	close(pfds[1].fd);
+	close(fd);
+	free(files);
+	free(changed);
+	free(indices);
+	free(statuses);
+	free(changed_statuses);
+	return status;
+}
+
+#else
+
+int
+watch_files(const char *const *paths, size_t npaths, size_t jobs)
+{
+	(void) paths;
+	(void) npaths;
+	(void) jobs;
+	errno = ENOTSUP;
+	eprintf("watching files:");
+	return EXIT_ERROR;
+}
+
+#endif